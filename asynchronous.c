@@ -1,6 +1,9 @@
 #include "asynchronous.h"
 #include "resource.h"
+#include "option.h"
+#include "subscribe.h"
 #include "mem.h"
+#include "prng.h"
 
 
 #define min(a,b) ((a) < (b) ? (a) : (b))
@@ -9,6 +12,8 @@ coap_registration_t *
 coap_registration_init(coap_key_t reskey, coap_address_t sub, str *token) {
 
 	coap_registration_t *s;
+	coap_tick_t now;
+
 	s = (coap_registration_t *)coap_malloc(sizeof(coap_registration_t));
 	if (!s)
 		return NULL;
@@ -18,7 +23,10 @@ coap_registration_init(coap_key_t reskey, coap_address_t sub, str *token) {
 	s->refcnt = 0;
 	s->invalid = 0;
 
-	s->notcnt = (short)rand(); //randomized RTP-like
+	/* randomized RTP-like; there is no context here, so take the
+	 * low bits of the clock rather than the locked rand() */
+	coap_ticks(&now);
+	s->notcnt = (short)coap_prng_mix(now ^ (uintptr_t)s);
 
 	s->srready = 0;
 	s->ntptwin = 0;
@@ -28,6 +36,11 @@ coap_registration_init(coap_key_t reskey, coap_address_t sub, str *token) {
 	s->last_sr_octcount = 0;
 	s->last_sr_packcount = 0;
 
+	s->max_inflight = COAP_OBS_MAX_INFLIGHT;
+
+	s->non = 1;
+	s->non_run = COAP_OBS_MAX_NON;
+
 	memcpy(s->reskey, reskey, 4);
 	memcpy(&(s->subscriber), &sub, sizeof(coap_address_t));
 
@@ -41,3 +54,115 @@ coap_registration_init(coap_key_t reskey, coap_address_t sub, str *token) {
 }
 
 
+
+void
+coap_registration_free(coap_registration_t *r) {
+	if (!r)
+		return;
+	coap_registration_unlease(r);
+	coap_registration_unbind(r);
+	coap_delete_pdu(r->pending);
+	coap_delete_pdu(r->last);
+	coap_delete_pdu(r->agg);
+	coap_free(r);
+}
+
+/* Parses a decimal number of seconds with at most three fractional
+ * digits into ticks. Returns 1 on success, 0 if s is malformed. */
+static int
+parse_seconds(const unsigned char *s, size_t len, coap_tick_t *result) {
+	unsigned long sec = 0, msec = 0, scale = 100;
+
+	if (!len)
+		return 0;
+
+	while (len && *s >= '0' && *s <= '9') {
+		sec = sec * 10 + (*s++ - '0');
+		len--;
+	}
+
+	if (len && *s == '.') {
+		s++; len--;
+		while (len && *s >= '0' && *s <= '9') {
+			msec += (*s++ - '0') * scale;
+			scale /= 10;
+			len--;
+		}
+	}
+
+	if (len)
+		return 0;
+
+	*result = sec * COAP_TICKS_PER_SECOND
+		+ msec * COAP_TICKS_PER_SECOND / 1000;
+	return 1;
+}
+
+/* Parses a decimal number. Returns 1 on success, 0 if s is malformed. */
+static int
+parse_number(const unsigned char *s, size_t len, unsigned long *result) {
+	unsigned long n = 0;
+
+	if (!len)
+		return 0;
+
+	while (len && *s >= '0' && *s <= '9') {
+		n = n * 10 + (*s++ - '0');
+		len--;
+	}
+
+	if (len)
+		return 0;
+
+	*result = n;
+	return 1;
+}
+
+void
+coap_registration_parse_query(coap_registration_t *r, coap_pdu_t *request) {
+	coap_opt_iterator_t opt_iter;
+	coap_opt_filter_t filter;
+	coap_tick_t pmin = 0, pmax = 0, lease = 0, freshness = 0;
+	unsigned long agg = 0, aggt = 0;
+	int fresh = 0;
+
+	assert(r);
+	assert(request);
+
+	coap_option_filter_clear(filter);
+	coap_option_setb(filter, COAP_OPTION_URI_QUERY);
+
+	coap_option_iterator_init(request, &opt_iter, filter);
+	while (coap_option_next(&opt_iter)) {
+		unsigned char *q = COAP_OPT_VALUE(opt_iter.option);
+		size_t len = COAP_OPT_LENGTH(opt_iter.option);
+
+		if (len > 5 && memcmp(q, "pmin=", 5) == 0)
+			parse_seconds(q + 5, len - 5, &pmin);
+		else if (len > 5 && memcmp(q, "pmax=", 5) == 0)
+			parse_seconds(q + 5, len - 5, &pmax);
+		else if (len > 4 && memcmp(q, "agg=", 4) == 0)
+			parse_number(q + 4, len - 4, &agg);
+		else if (len > 5 && memcmp(q, "aggt=", 5) == 0)
+			parse_number(q + 5, len - 5, &aggt);
+		else if (len > 6 && memcmp(q, "lease=", 6) == 0)
+			parse_seconds(q + 6, len - 6, &lease);
+		else if (len == 5 && memcmp(q, "fresh", 5) == 0)
+			fresh = 1;
+		else if (len > 10 && memcmp(q, "freshness=", 10) == 0)
+			parse_seconds(q + 10, len - 10, &freshness);
+	}
+
+	if (pmax && pmax <= pmin)
+		pmax = 0;
+
+	r->pmin = pmin;
+	r->pmax = pmax;
+	r->lease_time = lease;
+	r->refresh = fresh;
+	r->freshness = freshness;
+
+	/* the sample count of an aggregate is sent in one byte */
+	r->agg_max = min(agg, 255);
+	r->agg_time = aggt * COAP_TICKS_PER_SECOND / 1000;
+}
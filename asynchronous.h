@@ -12,17 +12,31 @@
 #define ZE_ASYNCHRNONOUS_H
 
 #include "config.h"
+
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
 #include "address.h"
 #include "hashkey.h"
 #include "pdu.h"
 #include "str.h"
+#include "coap_time.h"
+#include "peer.h"
 
 typedef struct coap_registration_t {
 	struct coap_registration_t *next; /**< next element in linked list */
   	coap_address_t subscriber;	    /**< address and port of subscriber */
+  	coap_peer_id_t peer;	/**< the peer of subscriber, once bound */
 
   	unsigned int non;		/**< send non-confirmable notifies if @c 1  */
-  	unsigned int non_cnt;	/**< up to 15 non-confirmable notifies allowed */
+  	unsigned int non_cnt;	/**< non-confirmable notifies since the last CON */
+  	unsigned int non_run;	/**< current limit for non_cnt */
+  	coap_tick_t srtt;		/**< smoothed RTT of confirmable notifies */
+  	coap_tick_t gap;		/**< smoothed time between notifies */
   	unsigned int fail_cnt;	    /**< up to 3 confirmable notifies can fail */
 
   	size_t token_length;		/**< actual length of token */
@@ -54,7 +68,12 @@ typedef struct coap_registration_t {
   	 * as per draft-loreto-core-coap-streaming-00 */
   	short notcnt;
 
-  	/* sender report, stream control parameters */
+  	/* sender report, stream control parameters.
+  	 * ntptwin and rtptwin are the wallclock and media timestamps
+  	 * of the same instant, kept by the streaming manager which sets
+  	 * srready once they are valid. The counters are updated by
+  	 * coap_notify() and reports are sent by the library, see
+  	 * COAP_SR_MIN_INTERVAL. */
   	int srready;
   	uint64_t ntptwin;
   	int rtptwin;
@@ -64,10 +83,123 @@ typedef struct coap_registration_t {
   	int last_sr_octcount;
   	int last_sr_packcount;
 
+  	coap_tick_t sr_last;	/**< when the last report was sent */
+  	coap_tick_t sr_next;	/**< when the next report is due, 0 if none */
+  	unsigned int sr_pos;	/**< position + 1 in the report heap, 0 if none */
+  	int sr_sensor_type;		/**< sensor type of the stream */
+
+  	/* notification rate control, as requested by the observer
+  	 * with the pmin and pmax Uri-Query attributes; 0 means no limit */
+  	coap_tick_t pmin;	/**< minimum period between notifications */
+  	coap_tick_t pmax;	/**< maximum period without notifications */
+  	coap_tick_t last_notify;	/**< when the last notification was sent */
+  	coap_tick_t due;	/**< when pending or a pmax refresh is due */
+  	unsigned int due_pos;	/**< position + 1 in the due heap, 0 if none */
+  	struct coap_registration_t *notify_next; /**< in the scheduler queue */
+  	int notify_queued;	/**< pending waits for the scheduler */
+
+  	/* The latest notification held back by pmin (newer ones replace it)
+  	 * and a copy of the last one sent, repeated when pmax expires. */
+  	coap_pdu_t *pending;
+  	coap_pdu_t *last;
+
+  	/* confirmable notifications in the sendqueue and their limit,
+  	 * see COAP_OBS_MAX_INFLIGHT */
+  	unsigned int inflight;
+  	unsigned int max_inflight;
+
+  	/* Confirmable notifications are not retransmitted after their
+  	 * data got stale, see coap_notify(). freshness, the Uri-Query
+  	 * attribute of that name, overrides the Max-Age of the
+  	 * notifications if set. */
+  	coap_tick_t freshness;
+  	unsigned int expired;	/**< notifications dropped as stale */
+  	unsigned int expired_run;	/**< ... since the last ACK */
+
+  	/* If set (Uri-Query attribute fresh), a retransmission carries the
+  	 * notification held back in pending, if any, instead of the old
+  	 * sample. */
+  	int refresh;
+
+  	/* The registration ends at lease unless the observer registers
+  	 * again, see COAP_OBS_LEASE. lease_time is the lease requested
+  	 * with the Uri-Query attribute lease. While a lease is running the
+  	 * registration is linked into the lease wheel of the context. */
+  	coap_tick_t lease_time;
+  	coap_tick_t lease;
+  	struct coap_registration_t *lease_next;
+  	struct coap_registration_t **lease_prev;
+
+  	/* links in the registration list of the peer, see coap_peer_t */
+  	struct coap_registration_t *peer_next;
+  	struct coap_registration_t **peer_prev;
+
+  	/* sample aggregation, as requested by the observer with the agg
+  	 * (samples) and aggt (milliseconds) Uri-Query attributes */
+  	unsigned int agg_max;	/**< samples per notification, 0 for no limit */
+  	coap_tick_t agg_time;	/**< longest time a sample is held back */
+  	coap_pdu_t *agg;		/**< notification being filled */
+  	unsigned int agg_cnt;	/**< samples in agg */
+  	coap_tick_t agg_deadline;	/**< when agg must be sent at the latest */
+  	struct coap_queue_t *agg_timer;	/**< sends agg on agg_deadline */
+
 } coap_registration_t;
 
 
 coap_registration_t *
 coap_registration_init(coap_key_t reskey, coap_address_t sub, str *token);
 
+/** Removes @p r from the lease wheel it is linked into, if any. */
+static inline void
+coap_registration_unlease(coap_registration_t *r) {
+	if (r->lease_prev) {
+		*r->lease_prev = r->lease_next;
+		if (r->lease_next)
+			r->lease_next->lease_prev = r->lease_prev;
+		r->lease_next = NULL;
+		r->lease_prev = NULL;
+	}
+}
+
+/** Removes @p r from the registration list of its peer, if any. */
+static inline void
+coap_registration_unbind(coap_registration_t *r) {
+	if (r->peer_prev) {
+		*r->peer_prev = r->peer_next;
+		if (r->peer_next)
+			r->peer_next->peer_prev = r->peer_prev;
+		r->peer_next = NULL;
+		r->peer_prev = NULL;
+	}
+}
+
+/**
+ * Releases the storage allocated for @p r, including any notification
+ * still held by it. Use coap_registration_release() to drop a
+ * reference instead.
+ */
+void
+coap_registration_free(coap_registration_t *r);
+
+/**
+ * Updates the notification attributes of @p r from the Uri-Query
+ * options of the registering @p request. Recognized attributes are
+ * @c pmin and @c pmax, both in seconds with an optional fraction
+ * (e.g. @c pmin=0.05), as well as @c agg, the number of samples to
+ * pack into one notification, and @c aggt, the time in milliseconds
+ * a sample may wait for others. @c lease sets the seconds the
+ * registration lives without another registering GET (see
+ * COAP_OBS_LEASE), and @c fresh, which has no value, makes
+ * retransmissions carry the latest held back sample. @c freshness is
+ * the time in seconds after which the sample of a confirmable
+ * notification is stale (see coap_notify()). Malformed values
+ * and a @c pmax not larger than @c pmin are ignored; attributes left
+ * out are reset.
+ *
+ * @param r       The registration to update.
+ * @param request The GET request that created or refreshed @p r.
+ */
+void
+coap_registration_parse_query(coap_registration_t *r, coap_pdu_t *request);
+
 #endif
@@ -0,0 +1,532 @@
+/* bench.c -- microbenchmarks of the library primitives
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file bench.c
+ * @brief microbenchmarks of the library primitives
+ *
+ * Each benchmark sets up its state for a given size, then runs its
+ * operation often enough to take at least the minimum time and
+ * reports the cost of one operation in nanoseconds. The iteration
+ * count is grown from one until a run is long enough, like in Go's
+ * testing package.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "coap.h"
+#include "prng.h"
+
+/* not declared in the headers, see net.c */
+int print_wellknown(coap_context_t *, unsigned char *, size_t *, coap_opt_t *);
+coap_alive_mid_t *coap_mid_alive_init();
+coap_alive_mid_t *mid_is_alive(coap_context_t *context, coap_queue_t *rcvd);
+
+/** Most options that a PDU of this draft can carry. */
+#define BENCH_MAX_OPTIONS 14
+
+typedef struct bench_t {
+  const char *name;
+  const char *unit;		/**< what the size parameter counts */
+  size_t size;			/**< default size */
+  int (*setup)(size_t size);
+  void (*run)(unsigned long n);
+  void (*teardown)(void);
+} bench_t;
+
+static size_t size;
+static coap_prng_t prng;
+static coap_context_t *ctx;
+static coap_pdu_t *pdu;
+static unsigned char *buf;
+static coap_key_t *keys;
+static coap_queue_t *queue;
+static coap_queue_t *node;
+
+/** Results go here so that the compiler keeps the work. */
+static volatile unsigned long sink;
+
+static unsigned long long
+bench_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+bench_order(coap_queue_t *lhs, coap_queue_t *rhs) {
+  return lhs && rhs && lhs->t < rhs->t ? -1 : 1;
+}
+
+static coap_context_t *
+bench_context(void) {
+  coap_address_t addr;
+
+  coap_address_init(&addr);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.addr.sin.sin_port = 0;
+  addr.size = sizeof(addr.addr.sin);
+  return coap_new_context(&addr);
+}
+
+/* Fills pdu with count Uri-Path options and one Uri-Query. */
+static int
+bench_options(coap_pdu_t *p, size_t count) {
+  static const unsigned char seg[] = "segment";
+  size_t i;
+
+  if (count > BENCH_MAX_OPTIONS - 1)
+    count = BENCH_MAX_OPTIONS - 1;
+  for (i = 0; i < count; i++)
+    if (!coap_add_option(p, COAP_OPTION_URI_PATH, sizeof(seg) - 1, seg))
+      return 0;
+  return coap_add_option(p, COAP_OPTION_URI_QUERY, 5,
+			 (const unsigned char *)"obs=1") != 0;
+}
+
+static void
+bench_free_pdu(void) {
+  coap_delete_pdu(pdu);
+  pdu = NULL;
+  free(buf);
+  buf = NULL;
+}
+
+/* pdu_init: allocate and release a PDU of size bytes */
+
+static int
+setup_pdu_init(size_t n) {
+  size = n;
+  return 1;
+}
+
+static void
+run_pdu_init(unsigned long n) {
+  coap_pdu_t *p;
+
+  while (n--) {
+    p = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, n, size);
+    sink += p->length;
+    coap_delete_pdu(p);
+  }
+}
+
+/* add_option: encode size options into a cleared PDU */
+
+static int
+setup_pdu(size_t n) {
+  size = n;
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, 1, COAP_MAX_PDU_SIZE);
+  buf = (unsigned char *)malloc(COAP_MAX_PDU_SIZE);
+  if (!pdu || !buf)
+    return 0;
+  memset(buf, 'x', COAP_MAX_PDU_SIZE);
+  return 1;
+}
+
+static void
+run_add_option(unsigned long n) {
+  while (n--) {
+    coap_pdu_clear(pdu, COAP_MAX_PDU_SIZE);
+    bench_options(pdu, size);
+    sink += pdu->length;
+  }
+}
+
+/* add_data: append size bytes of payload to a cleared PDU */
+
+static int
+setup_add_data(size_t n) {
+  if (n > COAP_MAX_PDU_SIZE - sizeof(coap_hdr_t))
+    n = COAP_MAX_PDU_SIZE - sizeof(coap_hdr_t);
+  return setup_pdu(n);
+}
+
+static void
+run_add_data(unsigned long n) {
+  while (n--) {
+    coap_pdu_clear(pdu, COAP_MAX_PDU_SIZE);
+    coap_add_data(pdu, size, buf);
+    sink += pdu->length;
+  }
+}
+
+/* option_iter: walk all options of a PDU with size Uri-Path options */
+
+static int
+setup_options(size_t n) {
+  return setup_pdu(n) && bench_options(pdu, n);
+}
+
+static void
+run_option_iter(unsigned long n) {
+  coap_opt_iterator_t oi;
+  coap_opt_t *opt;
+
+  while (n--) {
+    coap_option_iterator_init(pdu, &oi, COAP_OPT_ALL);
+    while ((opt = coap_option_next(&oi)))
+      sink += oi.type;
+  }
+}
+
+/* check_option: find the Uri-Query behind size Uri-Path options */
+
+static void
+run_check_option(unsigned long n) {
+  coap_opt_iterator_t oi;
+
+  while (n--)
+    sink += coap_check_option(pdu, COAP_OPTION_URI_QUERY, &oi) != NULL;
+}
+
+/* hash_request_uri: hash the Uri-Path of a request */
+
+static void
+run_hash_request_uri(unsigned long n) {
+  coap_key_t key;
+
+  while (n--) {
+    coap_hash_request_uri(pdu, key);
+    sink += key[0];
+  }
+}
+
+/* hash: hash a string of size bytes */
+
+static int
+setup_hash(size_t n) {
+  size = n;
+  buf = (unsigned char *)malloc(n + 1);
+  if (!buf)
+    return 0;
+  coap_prng_fill(&prng, buf, n);
+  return 1;
+}
+
+static void
+run_hash(unsigned long n) {
+  coap_key_t key;
+
+  while (n--) {
+    memset(key, 0, sizeof(coap_key_t));
+    coap_hash_impl(buf, size, key);
+    sink += key[0];
+  }
+}
+
+/* resource_lookup: find one of size resources by key */
+
+static int
+setup_resources(size_t n) {
+  coap_resource_t *r;
+  unsigned char *uri;
+  size_t i;
+  int len;
+
+  size = n;
+  ctx = bench_context();
+  keys = (coap_key_t *)malloc((n ? n : 1) * sizeof(coap_key_t));
+  if (!ctx || !keys)
+    return 0;
+
+  for (i = 0; i < n; i++) {
+    uri = (unsigned char *)malloc(32);
+    if (!uri)
+      return 0;
+    len = snprintf((char *)uri, 32, "sensors/%u/value", (unsigned int)i);
+    r = coap_resource_init(uri, len, COAP_RESOURCE_FLAGS_RELEASE_URI);
+    if (!r)
+      return 0;
+    coap_add_attr(r, (unsigned char *)"ct", 2, (unsigned char *)"0", 1, 0);
+    coap_add_attr(r, (unsigned char *)"rt", 2,
+		  (unsigned char *)"\"sensor\"", 8, 0);
+    coap_add_attr(r, (unsigned char *)"obs", 3, NULL, 0, 0);
+    coap_add_resource(ctx, r);
+    memcpy(keys[i], r->key, sizeof(coap_key_t));
+  }
+  return 1;
+}
+
+static void
+teardown_context(void) {
+  if (ctx)
+    coap_free_context(ctx);
+  ctx = NULL;
+  free(keys);
+  keys = NULL;
+  bench_free_pdu();
+}
+
+static void
+run_resource_lookup(unsigned long n) {
+  unsigned long i = 0;
+
+  while (n--) {
+    sink += coap_get_resource_from_key(ctx, keys[i]) != NULL;
+    if (++i == size)
+      i = 0;
+  }
+}
+
+/* print_wellknown: render the link format of size resources */
+
+static int
+setup_wellknown(size_t n) {
+  if (!setup_resources(n))
+    return 0;
+  buf = (unsigned char *)malloc(64 * (n + 1));
+  return buf != NULL;
+}
+
+static void
+run_print_wellknown(unsigned long n) {
+  size_t len;
+
+  while (n--) {
+    len = 64 * (size + 1);
+    print_wellknown(ctx, buf, &len, NULL);
+    sink += len;
+  }
+}
+
+/* queue: insert into and remove from a queue of size nodes */
+
+static int
+setup_queue(size_t n) {
+  coap_queue_t *q;
+  size_t i;
+
+  size = n;
+  for (i = 0; i < n; i++) {
+    q = coap_new_node();
+    if (!q)
+      return 0;
+    q->t = coap_prng_below(&prng, 1000000000ULL);
+    q->id = i + 1;
+    coap_insert_node(&queue, q, bench_order);
+  }
+
+  node = coap_new_node();
+  return node != NULL;
+}
+
+static void
+teardown_queue(void) {
+  coap_delete_all(queue);
+  queue = NULL;
+  coap_delete_node(node);
+  node = NULL;
+}
+
+static void
+run_queue(unsigned long n) {
+  coap_queue_t *q;
+
+  node->id = 0;
+  while (n--) {
+    node->t = coap_prng_below(&prng, 1000000000ULL);
+    coap_insert_node(&queue, node, bench_order);
+    coap_remove_from_queue(&queue, node->id, &q);
+    sink += q == node;
+  }
+}
+
+/* mid_is_alive: look up a message id that none of size records has */
+
+static int
+setup_alive(size_t n) {
+  coap_alive_mid_t *m;
+  size_t i;
+
+  size = n;
+  ctx = bench_context();
+  node = coap_new_node();
+  if (!ctx || !node)
+    return 0;
+
+  for (i = 0; i < n; i++) {
+    m = coap_mid_alive_init();
+    if (!m)
+      return 0;
+    m->mid = htons(i + 1);
+    m->peer_id = 1;
+    m->expiry = (coap_tick_t)-1;
+    m->next = (struct coap_alive_mid_t *)ctx->alive_mids;
+    ctx->alive_mids = m;
+  }
+
+  node->pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, 0,
+			    sizeof(coap_hdr_t));
+  node->peer = 1;
+  return node->pdu != NULL;
+}
+
+static void
+teardown_alive(void) {
+  coap_delete_node(node);
+  node = NULL;
+  teardown_context();
+}
+
+static void
+run_mid_is_alive(unsigned long n) {
+  while (n--)
+    sink += mid_is_alive(ctx, node) != NULL;
+}
+
+/* write_block_opt: add a Block2 option for size bytes of data */
+
+static void
+run_write_block_opt(unsigned long n) {
+  coap_block_t block;
+
+  block.szx = 6;
+  block.m = 0;
+  while (n--) {
+    coap_pdu_clear(pdu, COAP_MAX_PDU_SIZE);
+    block.num = n & 3;
+    coap_write_block_opt(&block, COAP_OPTION_BLOCK2, pdu, size);
+    sink += pdu->length;
+  }
+}
+
+static const bench_t benchmarks[] = {
+  { "pdu_init", "bytes", COAP_MAX_PDU_SIZE,
+    setup_pdu_init, run_pdu_init, NULL },
+  { "add_option", "options", 8, setup_pdu, run_add_option, bench_free_pdu },
+  { "add_data", "bytes", 256, setup_add_data, run_add_data, bench_free_pdu },
+  { "option_iter", "options", 8,
+    setup_options, run_option_iter, bench_free_pdu },
+  { "check_option", "options", 8,
+    setup_options, run_check_option, bench_free_pdu },
+  { "hash", "bytes", 32, setup_hash, run_hash, bench_free_pdu },
+  { "hash_request_uri", "options", 4,
+    setup_options, run_hash_request_uri, bench_free_pdu },
+  { "resource_lookup", "resources", 100,
+    setup_resources, run_resource_lookup, teardown_context },
+  { "print_wellknown", "resources", 20,
+    setup_wellknown, run_print_wellknown, teardown_context },
+  { "queue_insert_remove", "nodes", 100, setup_queue, run_queue, teardown_queue },
+  { "mid_is_alive", "records", 100,
+    setup_alive, run_mid_is_alive, teardown_alive },
+  { "write_block_opt", "bytes", 4096,
+    setup_pdu, run_write_block_opt, bench_free_pdu },
+  { NULL, NULL, 0, NULL, NULL, NULL }
+};
+
+/* Runs b with the given size for at least min_ns nanoseconds and
+ * returns the time per operation, or a negative value on error. */
+static double
+bench_run(const bench_t *b, size_t sz, unsigned long long min_ns) {
+  unsigned long n = 1;
+  unsigned long long t, elapsed;
+  double ns = -1;
+
+  coap_prng_seed(&prng, 1);
+  if (!b->setup(sz))
+    goto out;
+
+  for (;;) {
+    t = bench_ns();
+    b->run(n);
+    elapsed = bench_ns() - t;
+
+    if (elapsed >= min_ns || n >= 1UL << 30) {
+      ns = (double)elapsed / n;
+      break;
+    }
+
+    /* aim 20% past the minimum, but grow at most 100 times */
+    if (elapsed < min_ns / 100)
+      n *= 100;
+    else
+      n = (unsigned long)(n * 1.2 * min_ns / elapsed) + 1;
+  }
+
+ out:
+  if (b->teardown)
+    b->teardown();
+  return ns;
+}
+
+static void
+usage(const char *program) {
+  const bench_t *b;
+
+  fprintf(stderr,
+	  "usage: %s [-t ms] [-s size] [benchmark...]\n"
+	  "\t-t ms    minimum time per benchmark (default 200)\n"
+	  "\t-s size  size parameter for all benchmarks\n"
+	  "benchmarks:\n", program);
+  for (b = benchmarks; b->name; b++)
+    fprintf(stderr, "\t%-20s %s, default %u\n", b->name, b->unit,
+	    (unsigned int)b->size);
+}
+
+static int
+bench_selected(const char *name, int argc, char **argv) {
+  int i;
+
+  if (optind >= argc)
+    return 1;
+  for (i = optind; i < argc; i++)
+    if (strstr(name, argv[i]))
+      return 1;
+  return 0;
+}
+
+int
+main(int argc, char **argv) {
+  const bench_t *b;
+  unsigned long long min_ns = 200000000ULL;
+  size_t sz = 0;
+  double ns;
+  int opt, result = EXIT_SUCCESS;
+
+  while ((opt = getopt(argc, argv, "t:s:h")) != -1) {
+    switch (opt) {
+    case 't':
+      min_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+      break;
+    case 's':
+      sz = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  coap_set_log_level(LOG_CRIT);
+
+  printf("%-20s %10s %-9s %12s\n", "benchmark", "size", "", "ns/op");
+  for (b = benchmarks; b->name; b++) {
+    if (!bench_selected(b->name, argc, argv))
+      continue;
+
+    ns = bench_run(b, sz ? sz : b->size, min_ns);
+    if (ns < 0) {
+      printf("%-20s %10u %-9s %12s\n", b->name,
+	     (unsigned int)(sz ? sz : b->size), b->unit, "failed");
+      result = EXIT_FAILURE;
+    } else {
+      printf("%-20s %10u %-9s %12.1f\n", b->name,
+	     (unsigned int)(sz ? sz : b->size), b->unit, ns);
+    }
+    fflush(stdout);
+  }
+
+  return result;
+}
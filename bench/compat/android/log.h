@@ -0,0 +1,13 @@
+/* android/log.h -- stand-in for the NDK header on Linux hosts
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#ifndef _COMPAT_ANDROID_LOG_H_
+#define _COMPAT_ANDROID_LOG_H_
+
+/* debug.h includes this header, the library itself only logs through
+ * the LOG* macros of ze_log.h */
+
+#endif /* _COMPAT_ANDROID_LOG_H_ */
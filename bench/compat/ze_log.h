@@ -0,0 +1,23 @@
+/* ze_log.h -- stand-in for the ZeSense logging header on Linux hosts
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#ifndef _COMPAT_ZE_LOG_H_
+#define _COMPAT_ZE_LOG_H_
+
+/* Logging would dominate the measurements, define BENCH_LOG to see
+ * it anyway. */
+#ifdef BENCH_LOG
+#include <stdio.h>
+#define LOGI(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGW(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#define LOGE(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#else /* BENCH_LOG */
+#define LOGI(...) ((void)0)
+#define LOGW(...) ((void)0)
+#define LOGE(...) ((void)0)
+#endif /* BENCH_LOG */
+
+#endif /* _COMPAT_ZE_LOG_H_ */
@@ -0,0 +1,14 @@
+/* ze_sm_reqbuf.h -- stand-in for the ZeSense request buffer header
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#ifndef _COMPAT_ZE_SM_REQBUF_H_
+#define _COMPAT_ZE_SM_REQBUF_H_
+
+/* The library only keeps a pointer to the buffer of the streaming
+ * manager, the type can stay opaque. */
+typedef struct ze_sm_request_buf_t ze_sm_request_buf_t;
+
+#endif /* _COMPAT_ZE_SM_REQBUF_H_ */
@@ -0,0 +1,28 @@
+/* ze_sm_resbuf.h -- stand-in for the ZeSense response buffer header
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+#ifndef _COMPAT_ZE_SM_RESBUF_H_
+#define _COMPAT_ZE_SM_RESBUF_H_
+
+/* net.h relies on this header for the registration types */
+#include "asynchronous.h"
+
+/* The library only keeps a pointer to the buffer of the streaming
+ * manager, the type can stay opaque. */
+typedef struct ze_sm_response_buf_t ze_sm_response_buf_t;
+
+/** packet_type of a sample */
+#define DATAPOINT 1
+/** packet_type of a retransmitted sample */
+#define DATAPOINT_RETRANSMITTED 3
+
+/** The header that starts the payload of every notification. */
+typedef struct {
+  int packet_type;
+  int sensor_type;
+} ze_payload_header_t;
+
+#endif /* _COMPAT_ZE_SM_RESBUF_H_ */
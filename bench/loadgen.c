@@ -0,0 +1,1059 @@
+/* loadgen.c -- loopback load generator for request and observe traffic
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file loadgen.c
+ * @brief loopback load generator for request and observe traffic
+ *
+ * Runs a server context in a thread of its own and drives it over
+ * loopback UDP from plain sockets, so that coap_read(),
+ * coap_dispatch(), handle_request() and the notification paths are
+ * exercised end to end without phones. The server offers
+ *
+ * - @c load, answering every GET with 2.05, and
+ * - @c obs/0 ... @c obs/R-1, observable resources that notify every
+ *   observer at a fixed rate.
+ *
+ * The client floods @c load with CON or NON requests, open loop at a
+ * target rate or closed loop with a fixed window, and registers any
+ * number of observers, each on a socket of its own so that the
+ * server sees distinct peers. Observers acknowledge, reject or ignore
+ * confirmable notifications with given probabilities, optionally
+ * after a delay. Duplicate and malformed requests can be mixed in.
+ *
+ * Every response and notification carries the time it was made, so
+ * the client measures latency without synchronizing clocks: both
+ * ends run in the same process.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "coap.h"
+#include "prng.h"
+#include "metrics.h"
+#include "utlist.h"
+
+/** Trailer at the end of every payload: sequence number and time. */
+#define LG_TRAILER 12
+
+/** Longest time the server waits for input, in milliseconds. */
+#define LG_POLL_MAX 100
+
+/** Registrations are sent again if not answered within this time. */
+#define LG_REGISTER_RETRY (1000000000ULL)
+
+typedef struct {
+  double duration;		/**< seconds of load */
+  unsigned long rate;		/**< requests per second, 0 for closed loop */
+  unsigned int window;		/**< outstanding requests, 0 for none */
+  unsigned int sockets;		/**< sockets sending requests */
+  int non;			/**< send NON instead of CON requests */
+  unsigned int observers;	/**< number of observers */
+  unsigned int resources;	/**< observable resources */
+  double notify_rate;		/**< notifications per second and resource */
+  double con;			/**< fraction of CON notifications */
+  double ack;			/**< probability of acknowledging a CON */
+  double rst;			/**< probability of rejecting a CON */
+  unsigned int ack_delay;	/**< ACK delay in milliseconds */
+  const char *query;		/**< Uri-Query of registrations */
+  double dup;			/**< fraction of duplicated requests */
+  double malformed;		/**< fraction of malformed requests */
+  unsigned int payload;		/**< payload bytes of notifications */
+  unsigned int timeout;		/**< request timeout in milliseconds */
+} lg_options_t;
+
+static lg_options_t opt = {
+  10.0, 0, 64, 8, 0, 0, 1, 10.0, 0.1, 1.0, 0.0, 0, NULL, 0.0, 0.0, 16, 2000
+};
+
+/* ---------------------------------------------------------------- */
+/* server                                                           */
+
+typedef struct {
+  coap_context_t *ctx;
+  unsigned short port;
+  volatile int stop;
+  volatile int quiet;		/**< stop notifying, the client is done */
+  unsigned int *seq;		/**< notification sequence per observer */
+  unsigned int *sent;		/**< notifications sent per observer */
+  unsigned long deferred;	/**< notifications held back by coap_notify() */
+  coap_registration_t **unregistered;	/**< released by the server loop */
+  unsigned int nunregistered;
+  unsigned int unregistered_size;
+  coap_prng_t prng;
+
+  /* results */
+  double cpu;			/**< seconds of CPU time */
+  coap_metrics_t metrics;
+  size_t registrations;		/**< valid registrations at the end */
+} lg_server_t;
+
+static lg_server_t server;
+
+static unsigned long long
+lg_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double
+lg_random(coap_prng_t *r) {
+  return coap_prng_next(r) / 4294967296.0;
+}
+
+static void
+lg_put32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t
+lg_get32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Appends a payload of len filler bytes and the trailer to pdu. */
+static void
+lg_add_payload(coap_pdu_t *pdu, unsigned int len, uint32_t seq) {
+  unsigned char buf[COAP_MAX_PDU_SIZE];
+  ze_payload_header_t header;
+  unsigned long long now = lg_ns();
+  size_t n = sizeof(header) + len;
+
+  if (n + LG_TRAILER > sizeof(buf) - 64)
+    n = sizeof(buf) - 64 - LG_TRAILER;
+
+  memset(buf, 'x', n);
+  memset(&header, 0, sizeof(header));
+  header.packet_type = DATAPOINT;
+  memcpy(buf, &header, sizeof(header));
+  lg_put32(buf + n, seq);
+  lg_put32(buf + n + 4, now >> 32);
+  lg_put32(buf + n + 8, now);
+  coap_add_data(pdu, n + LG_TRAILER, buf);
+}
+
+static void
+hnd_get_load(coap_context_t *ctx, struct coap_resource_t *resource,
+	     coap_address_t *peer, coap_pdu_t *request, str *token,
+	     coap_pdu_t *response) {
+  (void)ctx;
+  (void)resource;
+  (void)peer;
+  (void)request;
+
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  if (token->length)
+    coap_add_option(response, COAP_OPTION_TOKEN, token->length, token->s);
+  lg_add_payload(response, 0, 0);
+}
+
+static void
+hnd_get_obs(coap_context_t *ctx, struct coap_resource_t *resource,
+	    coap_address_t *peer, coap_pdu_t *request, str *token,
+	    coap_pdu_t *response) {
+  coap_opt_iterator_t oi;
+  coap_registration_t *reg, *found;
+  unsigned char obs[2] = { 0, 0 };
+
+  (void)ctx;
+
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  if (coap_check_option(request, COAP_OPTION_SUBSCRIPTION, &oi)) {
+    found = coap_find_registration(resource, peer);
+    reg = coap_add_registration(resource, peer, token);
+    if (reg && !found)
+      coap_registration_checkout(reg); /* held until on_unregister */
+    coap_add_option(response, COAP_OPTION_SUBSCRIPTION, sizeof(obs), obs);
+  }
+  if (token->length)
+    coap_add_option(response, COAP_OPTION_TOKEN, token->length, token->s);
+  lg_add_payload(response, opt.payload, 0);
+}
+
+/* Registrations are released by the server loop, not while the
+ * library is still walking them. */
+static void
+lg_unregister(coap_context_t *ctx, coap_registration_t *reg) {
+  coap_registration_t **regs;
+  unsigned int size;
+
+  (void)ctx;
+
+  if (reg->invalid)
+    return;
+
+  /* observers that register again can be dropped more than once */
+  if (server.nunregistered == server.unregistered_size) {
+    size = 2 * server.unregistered_size;
+    regs = (coap_registration_t **)
+      realloc(server.unregistered, size * sizeof(coap_registration_t *));
+    if (!regs) {
+      fprintf(stderr, "cannot keep dropped registration\n");
+      return;
+    }
+    server.unregistered = regs;
+    server.unregistered_size = size;
+  }
+
+  reg->invalid = 1;
+  server.unregistered[server.nunregistered++] = reg;
+}
+
+static void
+lg_release_unregistered(coap_context_t *ctx) {
+  coap_registration_t *reg;
+  coap_resource_t *r;
+
+  while (server.nunregistered) {
+    reg = server.unregistered[--server.nunregistered];
+    r = coap_get_resource_from_key(ctx, reg->reskey);
+    if (r)
+      coap_registration_release(r, reg);
+  }
+}
+
+static void
+lg_notify_all(coap_context_t *ctx) {
+  coap_resource_t *r, *rtmp;
+  coap_registration_t *reg, *tmp;
+  coap_pdu_t *pdu;
+  unsigned char obs[2];
+  coap_tid_t tid;
+  uint32_t id;
+
+  HASH_ITER(hh, ctx->resources, r, rtmp) {
+    if (!r->observable)
+      continue;
+
+    LL_FOREACH_SAFE(r->subscribers, reg, tmp) {
+      if (reg->invalid || reg->token_length != 4)
+	continue;
+      id = lg_get32(reg->token);
+      if (id >= opt.observers)
+	continue;
+
+      pdu = coap_pdu_init(lg_random(&server.prng) < opt.con
+			  ? COAP_MESSAGE_CON : COAP_MESSAGE_NON,
+			  COAP_RESPONSE_CODE(205),
+			  coap_new_peer_message_id(ctx, &reg->subscriber),
+			  COAP_MAX_PDU_SIZE);
+      if (!pdu)
+	continue;
+
+      reg->notcnt++;
+      obs[0] = (unsigned short)reg->notcnt >> 8;
+      obs[1] = (unsigned short)reg->notcnt & 0xff;
+      coap_add_option(pdu, COAP_OPTION_SUBSCRIPTION, sizeof(obs), obs);
+      coap_add_option(pdu, COAP_OPTION_TOKEN, reg->token_length, reg->token);
+      lg_add_payload(pdu, opt.payload, ++server.seq[id]);
+
+      /* held back notifications are replaced by later ones or sent
+       * by coap_check_notify(), so only those sent now are expected */
+      tid = coap_notify(ctx, pdu, reg);
+      if (tid == COAP_NOTIFY_DEFERRED)
+	server.deferred++;
+      else if (tid != COAP_INVALID_TID)
+	server.sent[id]++;
+    }
+  }
+}
+
+static void *
+lg_server_main(void *arg) {
+  coap_context_t *ctx = server.ctx;
+  struct pollfd pfd;
+  struct timespec cpu0, cpu1;
+  coap_queue_t *next;
+  coap_tick_t now, deadline, round = 0, interval = 0;
+  int timeout, budget;
+
+  (void)arg;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+
+  if (opt.observers && opt.notify_rate > 0)
+    interval = (coap_tick_t)(COAP_TICKS_PER_SECOND / opt.notify_rate);
+
+  pfd.fd = ctx->sockfd;
+  pfd.events = POLLIN;
+
+  while (!server.stop) {
+    now = coap_clock_update(ctx);
+    timeout = LG_POLL_MAX;
+    if (coap_next_deadline(ctx, &deadline))
+      timeout = deadline <= now ? 0
+	: (int)((deadline - now) / (COAP_TICKS_PER_SECOND / 1000));
+    if (interval) {
+      if (round <= now)
+	timeout = 0;
+      else if ((round - now) / (COAP_TICKS_PER_SECOND / 1000) < (coap_tick_t)timeout)
+	timeout = (round - now) / (COAP_TICKS_PER_SECOND / 1000);
+    }
+    if (timeout > LG_POLL_MAX)
+      timeout = LG_POLL_MAX;
+
+    if (poll(&pfd, 1, timeout) > 0) {
+      budget = 256;
+      do
+	coap_read(ctx);
+      while (--budget && poll(&pfd, 1, 0) > 0);
+      coap_dispatch(ctx);
+    }
+
+    now = coap_clock_update(ctx);
+    while ((next = coap_peek_next(ctx)) && next->t <= now)
+      coap_retransmit(ctx, coap_pop_next(ctx));
+
+    if (interval && round <= now && !server.quiet) {
+      lg_notify_all(ctx);
+      round = (round ? round : now) + interval;
+      if (round < now)
+	round = now;	/* do not catch up after a stall */
+    }
+
+    lg_release_unregistered(ctx);
+    coap_check_notify(ctx);
+  }
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+  server.cpu = (cpu1.tv_sec - cpu0.tv_sec) + (cpu1.tv_nsec - cpu0.tv_nsec) / 1e9;
+  coap_metrics_snapshot(ctx, &server.metrics);
+  server.registrations = server.metrics.registrations;
+  return NULL;
+}
+
+static int
+lg_server_init(void) {
+  coap_address_t addr;
+  coap_resource_t *r;
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  unsigned char *uri;
+  unsigned int i;
+  int size = 8 << 20;
+
+  coap_address_init(&addr);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.size = sizeof(addr.addr.sin);
+
+  server.ctx = coap_new_context(&addr);
+  if (!server.ctx)
+    return 0;
+  setsockopt(server.ctx->sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  setsockopt(server.ctx->sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  if (getsockname(server.ctx->sockfd, (struct sockaddr *)&sin, &len) < 0)
+    return 0;
+  server.port = ntohs(sin.sin_port);
+  coap_prng_seed(&server.prng, 2);
+
+  r = coap_resource_init((unsigned char *)"load", 4, 0);
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_get_load);
+  coap_add_resource(server.ctx, r);
+
+  for (i = 0; i < opt.resources; i++) {
+    uri = (unsigned char *)malloc(16);
+    if (!uri)
+      return 0;
+    r = coap_resource_init(uri, snprintf((char *)uri, 16, "obs/%u", i),
+			   COAP_RESOURCE_FLAGS_RELEASE_URI);
+    r->observable = 1;
+    r->on_unregister = lg_unregister;
+    coap_register_handler(r, COAP_REQUEST_GET, hnd_get_obs);
+    coap_add_resource(server.ctx, r);
+  }
+
+  server.seq = (unsigned int *)calloc(opt.observers + 1, sizeof(unsigned int));
+  server.sent = (unsigned int *)calloc(opt.observers + 1, sizeof(unsigned int));
+  server.unregistered = (coap_registration_t **)
+    calloc(opt.observers + 1, sizeof(coap_registration_t *));
+  server.unregistered_size = opt.observers + 1;
+  return server.seq && server.sent && server.unregistered;
+}
+
+/* ---------------------------------------------------------------- */
+/* client                                                           */
+
+/** An outstanding request. */
+typedef struct {
+  unsigned long long sent;	/**< 0 if the slot is free */
+  unsigned short gen;		/**< generation, part of the token */
+} lg_slot_t;
+
+/** An observer, one per socket. */
+typedef struct {
+  int fd;
+  unsigned long long registered;	/**< time of the last registration */
+  int confirmed;		/**< registration answered */
+  uint32_t max_seq;		/**< highest sequence number seen */
+  uint64_t window;		/**< bitmap of the 64 seqs up to max_seq */
+  unsigned long received;	/**< distinct notifications */
+} lg_observer_t;
+
+/** An ACK or RST waiting for its delay. */
+typedef struct {
+  unsigned long long due;
+  int fd;
+  unsigned short mid;		/**< network byte order */
+  unsigned char type;
+} lg_reply_t;
+
+typedef struct {
+  coap_prng_t prng;
+  struct sockaddr_in server;
+  int epfd;
+
+  int *fds;			/**< request sockets */
+  unsigned short *mid;		/**< next message id per request socket */
+  unsigned char (*last)[COAP_MAX_PDU_SIZE];	/**< last request per socket */
+  size_t *last_len;
+
+  lg_slot_t *slots;
+  unsigned int free_slot;	/**< where to look for a free slot */
+  unsigned int outstanding;
+
+  lg_observer_t *obs;
+
+  lg_reply_t *replies;		/**< ring of delayed replies */
+  unsigned int reply_head, reply_tail, reply_size;
+
+  /* results */
+  unsigned long requests, responses, timeouts, late, throttled;
+  unsigned long duplicates, malformed, other;
+  unsigned long notifications, notify_dups, acks, rsts, ignored;
+  coap_histogram_t latency;
+  coap_histogram_t notify_latency;
+} lg_client_t;
+
+static lg_client_t client;
+
+static int
+lg_socket(void) {
+  struct sockaddr_in sin;
+  int fd, size = 1 << 20;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return -1;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+static int
+lg_watch(int fd, unsigned int index) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = index;
+  return epoll_ctl(client.epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static void
+lg_send(int fd, const void *data, size_t len) {
+  if (sendto(fd, data, len, 0, (struct sockaddr *)&client.server,
+	     sizeof(client.server)) < 0 && errno != EAGAIN)
+    perror("sendto");
+}
+
+static void
+lg_send_pdu(int fd, coap_pdu_t *pdu) {
+  lg_send(fd, pdu->hdr, pdu->length);
+}
+
+/* Sends a malformed request of one of several kinds. */
+static void
+lg_send_malformed(int fd, unsigned short mid) {
+  unsigned char buf[16];
+  coap_pdu_t *pdu;
+
+  switch (coap_prng_below(&client.prng, 3)) {
+  case 0:			/* unknown version */
+    buf[0] = 0x00 | COAP_MESSAGE_CON << 4;
+    buf[1] = COAP_REQUEST_GET;
+    memcpy(buf + 2, &mid, 2);
+    lg_send(fd, buf, 4);
+    break;
+  case 1:			/* options beyond the end */
+    buf[0] = COAP_DEFAULT_VERSION << 6 | COAP_MESSAGE_CON << 4 | 5;
+    buf[1] = COAP_REQUEST_GET;
+    memcpy(buf + 2, &mid, 2);
+    buf[4] = 0xb4;		/* Uri-Path of 4 bytes, then nothing */
+    lg_send(fd, buf, 5);
+    break;
+  default:			/* unknown critical option */
+    pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET, mid, 64);
+    if (pdu) {
+      coap_add_option(pdu, COAP_OPTION_URI_PATH, 4, (unsigned char *)"load");
+      coap_add_option(pdu, 13, 1, (unsigned char *)"x");
+      lg_send_pdu(fd, pdu);
+      coap_delete_pdu(pdu);
+    }
+  }
+}
+
+/* Sends one request to load, returns 0 if the window is full. */
+static int
+lg_request(unsigned long long now) {
+  unsigned char token[4];
+  unsigned int i, s;
+  lg_slot_t *slot;
+  coap_pdu_t *pdu;
+  unsigned short mid;
+  int fd;
+
+  if (client.outstanding >= opt.window)
+    return 0;
+
+  for (i = client.free_slot; client.slots[i].sent; )
+    if (++i == opt.window)
+      i = 0;
+  client.free_slot = i + 1 == opt.window ? 0 : i + 1;
+  slot = &client.slots[i];
+
+  s = coap_prng_below(&client.prng, opt.sockets);
+  fd = client.fds[s];
+  mid = htons(client.mid[s]++);
+
+  if (opt.malformed > 0 && lg_random(&client.prng) < opt.malformed) {
+    lg_send_malformed(fd, mid);
+    client.malformed++;
+    return 1;
+  }
+
+  if (opt.dup > 0 && client.last_len[s] && lg_random(&client.prng) < opt.dup) {
+    lg_send(fd, client.last[s], client.last_len[s]);
+    client.duplicates++;
+    return 1;
+  }
+
+  pdu = coap_pdu_init(opt.non ? COAP_MESSAGE_NON : COAP_MESSAGE_CON,
+		      COAP_REQUEST_GET, mid, 64);
+  if (!pdu)
+    return 0;
+
+  slot->gen++;
+  lg_put32(token, i << 16 | slot->gen);
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, 4, (unsigned char *)"load");
+  coap_add_option(pdu, COAP_OPTION_TOKEN, sizeof(token), token);
+
+  slot->sent = now;
+  client.outstanding++;
+  client.requests++;
+  lg_send_pdu(fd, pdu);
+
+  memcpy(client.last[s], pdu->hdr, pdu->length);
+  client.last_len[s] = pdu->length;
+  coap_delete_pdu(pdu);
+  return 1;
+}
+
+static void
+lg_register(unsigned int i, unsigned long long now) {
+  unsigned char token[4], path[16];
+  coap_pdu_t *pdu;
+  int len;
+
+  pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET,
+		      htons((unsigned short)coap_prng_next(&client.prng)), 128);
+  if (!pdu)
+    return;
+
+  lg_put32(token, i);
+  len = snprintf((char *)path, sizeof(path), "%u", i % opt.resources);
+  coap_add_option(pdu, COAP_OPTION_SUBSCRIPTION, 0, NULL);
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, 3, (unsigned char *)"obs");
+  coap_add_option(pdu, COAP_OPTION_URI_PATH, len, path);
+  if (opt.query)
+    coap_add_option(pdu, COAP_OPTION_URI_QUERY, strlen(opt.query),
+		    (const unsigned char *)opt.query);
+  coap_add_option(pdu, COAP_OPTION_TOKEN, sizeof(token), token);
+
+  lg_send_pdu(client.obs[i].fd, pdu);
+  client.obs[i].registered = now;
+  coap_delete_pdu(pdu);
+}
+
+static void
+lg_reply(int fd, unsigned short mid, unsigned char type) {
+  unsigned char buf[4];
+
+  buf[0] = COAP_DEFAULT_VERSION << 6 | type << 4;
+  buf[1] = 0;
+  memcpy(buf + 2, &mid, 2);
+  lg_send(fd, buf, sizeof(buf));
+}
+
+static void
+lg_reply_later(int fd, unsigned short mid, unsigned char type,
+	       unsigned long long due) {
+  unsigned int next = (client.reply_head + 1) % client.reply_size;
+  lg_reply_t *r;
+
+  if (next == client.reply_tail) {	/* full, send now */
+    lg_reply(fd, mid, type);
+    return;
+  }
+  r = &client.replies[client.reply_head];
+  r->due = due;
+  r->fd = fd;
+  r->mid = mid;
+  r->type = type;
+  client.reply_head = next;
+}
+
+static void
+lg_flush_replies(unsigned long long now) {
+  lg_reply_t *r;
+
+  while (client.reply_tail != client.reply_head) {
+    r = &client.replies[client.reply_tail];
+    if (r->due > now)
+      break;
+    lg_reply(r->fd, r->mid, r->type);
+    client.reply_tail = (client.reply_tail + 1) % client.reply_size;
+  }
+}
+
+/* Returns the time stamp in the trailer of a datagram, 0 if none. */
+static unsigned long long
+lg_trailer(const unsigned char *buf, size_t len, uint32_t *seq) {
+  if (len < sizeof(coap_hdr_t) + LG_TRAILER)
+    return 0;
+  buf += len - LG_TRAILER;
+  *seq = lg_get32(buf);
+  return (unsigned long long)lg_get32(buf + 4) << 32 | lg_get32(buf + 8);
+}
+
+/* Wraps a received datagram for the option functions. */
+static const unsigned char *
+lg_token(unsigned char *buf, size_t len, int *observe) {
+  coap_opt_iterator_t oi;
+  coap_opt_t *o;
+  coap_pdu_t pdu;
+
+  memset(&pdu, 0, sizeof(pdu));
+  pdu.hdr = (coap_hdr_t *)buf;
+  pdu.length = len;
+  pdu.max_size = len;
+
+  *observe = coap_check_option(&pdu, COAP_OPTION_SUBSCRIPTION, &oi) != NULL;
+  o = coap_check_option(&pdu, COAP_OPTION_TOKEN, &oi);
+  if (!o || COAP_OPT_LENGTH(o) != 4)
+    return NULL;
+  return COAP_OPT_VALUE(o);
+}
+
+static void
+lg_response(unsigned char *buf, size_t len, unsigned long long now) {
+  const unsigned char *token;
+  unsigned int i;
+  uint32_t t, seq;
+  int observe;
+
+  token = lg_token(buf, len, &observe);
+  if (!token || !lg_trailer(buf, len, &seq)) {
+    client.other++;		/* empty ACKs, error responses */
+    return;
+  }
+
+  t = lg_get32(token);
+  i = t >> 16;
+  if (i >= opt.window || !client.slots[i].sent
+      || client.slots[i].gen != (t & 0xffff)) {
+    client.late++;
+    return;
+  }
+
+  coap_histogram_add(&client.latency, now - client.slots[i].sent);
+  client.slots[i].sent = 0;
+  client.outstanding--;
+  client.responses++;
+}
+
+static void
+lg_notification(unsigned int i, unsigned char *buf, size_t len,
+		unsigned long long now) {
+  lg_observer_t *o = &client.obs[i];
+  coap_hdr_t *hdr = (coap_hdr_t *)buf;
+  unsigned long long sent;
+  uint32_t seq, d;
+  int observe;
+
+  if (!lg_token(buf, len, &observe) || !(sent = lg_trailer(buf, len, &seq))) {
+    client.other++;
+    return;
+  }
+
+  if (hdr->type == COAP_MESSAGE_CON) {
+    double p = lg_random(&client.prng);
+
+    if (p < opt.rst) {
+      lg_reply_later(o->fd, hdr->id, COAP_MESSAGE_RST, now);
+      client.rsts++;
+      return;
+    } else if (p < opt.rst + opt.ack) {
+      lg_reply_later(o->fd, hdr->id, COAP_MESSAGE_ACK,
+		     now + opt.ack_delay * 1000000ULL);
+      client.acks++;
+    } else {
+      client.ignored++;
+    }
+  }
+
+  if (seq == 0) {		/* the response to the registration */
+    o->confirmed = 1;
+    return;
+  }
+
+  /* count every sequence number once, within a window of 64 */
+  if (seq > o->max_seq) {
+    d = seq - o->max_seq;
+    o->window = d < 64 ? o->window << d | 1 : 1;
+    o->max_seq = seq;
+  } else {
+    d = o->max_seq - seq;
+    if (d >= 64 || (o->window >> d & 1)) {
+      client.notify_dups++;
+      return;
+    }
+    o->window |= (uint64_t)1 << d;
+  }
+
+  o->received++;
+  client.notifications++;
+  coap_histogram_add(&client.notify_latency, now - sent);
+}
+
+static void
+lg_receive(unsigned int index, unsigned long long now) {
+  unsigned char buf[COAP_MAX_PDU_SIZE];
+  ssize_t len;
+  int fd = index < opt.sockets ? client.fds[index]
+    : client.obs[index - opt.sockets].fd;
+
+  while ((len = recv(fd, buf, sizeof(buf), 0)) >= (ssize_t)sizeof(coap_hdr_t)) {
+    if (index < opt.sockets)
+      lg_response(buf, len, now);
+    else
+      lg_notification(index - opt.sockets, buf, len, now);
+  }
+}
+
+static void
+lg_expire(unsigned long long now) {
+  unsigned long long limit = opt.timeout * 1000000ULL;
+  unsigned int i;
+
+  for (i = 0; i < opt.window; i++) {
+    if (client.slots[i].sent && now - client.slots[i].sent > limit) {
+      client.slots[i].sent = 0;
+      client.outstanding--;
+      client.timeouts++;
+    }
+  }
+}
+
+static int
+lg_client_init(void) {
+  unsigned int i;
+
+  coap_prng_seed(&client.prng, 1);
+  client.server.sin_family = AF_INET;
+  client.server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  client.server.sin_port = htons(server.port);
+
+  client.epfd = epoll_create1(0);
+  if (client.epfd < 0)
+    return 0;
+
+  if (opt.window) {
+    client.fds = (int *)calloc(opt.sockets, sizeof(int));
+    client.mid = (unsigned short *)calloc(opt.sockets, sizeof(unsigned short));
+    client.last = calloc(opt.sockets, COAP_MAX_PDU_SIZE);
+    client.last_len = (size_t *)calloc(opt.sockets, sizeof(size_t));
+    client.slots = (lg_slot_t *)calloc(opt.window, sizeof(lg_slot_t));
+    if (!client.fds || !client.mid || !client.last || !client.last_len
+	|| !client.slots)
+      return 0;
+
+    for (i = 0; i < opt.sockets; i++) {
+      client.fds[i] = lg_socket();
+      if (client.fds[i] < 0 || !lg_watch(client.fds[i], i))
+	return 0;
+      client.mid[i] = (unsigned short)coap_prng_next(&client.prng);
+    }
+  }
+
+  client.obs = (lg_observer_t *)calloc(opt.observers + 1, sizeof(lg_observer_t));
+  client.reply_size = 4 * opt.observers + 16;
+  client.replies = (lg_reply_t *)calloc(client.reply_size, sizeof(lg_reply_t));
+  if (!client.obs || !client.replies)
+    return 0;
+
+  for (i = 0; i < opt.observers; i++) {
+    client.obs[i].fd = lg_socket();
+    if (client.obs[i].fd < 0) {
+      fprintf(stderr, "cannot open socket for observer %u: %s\n", i,
+	      strerror(errno));
+      return 0;
+    }
+    if (!lg_watch(client.obs[i].fd, opt.sockets + i))
+      return 0;
+  }
+  return 1;
+}
+
+static void
+lg_client_run(void) {
+  struct epoll_event events[256];
+  unsigned long long start, now, end, drain, next_expire = 0;
+  unsigned long long due;
+  unsigned int i;
+  int n, timeout;
+
+  start = now = lg_ns();
+  end = start + (unsigned long long)(opt.duration * 1e9);
+  drain = end + (opt.timeout < 1000 ? opt.timeout : 1000) * 1000000ULL;
+
+  while (now < drain) {
+    timeout = 1;
+
+    if (now < end) {
+      /* requests, open or closed loop */
+      if (opt.window) {
+	if (opt.rate) {
+	  due = (unsigned long long)((now - start) / 1e9 * opt.rate);
+	  while (client.requests + client.duplicates + client.malformed
+		 + client.throttled < due) {
+	    if (!lg_request(now))
+	      client.throttled++;
+	  }
+	} else {
+	  while (lg_request(now))
+	    ;
+	}
+      }
+
+      /* (re-)register observers */
+      for (i = 0; i < opt.observers; i++)
+	if (!client.obs[i].confirmed
+	    && (!client.obs[i].registered
+		|| now - client.obs[i].registered > LG_REGISTER_RETRY))
+	  lg_register(i, now);
+    }
+
+    n = epoll_wait(client.epfd, events, 256, timeout);
+    now = lg_ns();
+    while (n-- > 0)
+      lg_receive(events[n].data.u32, now);
+
+    if (now >= end)
+      server.quiet = 1;
+
+    lg_flush_replies(now);
+    if (now >= next_expire) {
+      lg_expire(now);
+      next_expire = now + 10000000ULL;
+    }
+  }
+}
+
+/* ---------------------------------------------------------------- */
+/* report                                                           */
+
+static double
+lg_us(const coap_histogram_t *h, double q) {
+  return coap_histogram_percentile(h, q) / 1000.0;
+}
+
+static void
+lg_report(double seconds) {
+  const coap_metrics_t *m = &server.metrics;
+  unsigned long long in = 0, lost = 0, expected = 0;
+  unsigned int i, registered = 0;
+
+  for (i = COAP_METRIC_IN_CON; i <= COAP_METRIC_IN_RST; i++)
+    in += m->counter[i];
+
+  printf("duration        %.2f s\n", seconds);
+
+  if (opt.window) {
+    printf("requests        %lu %s (%.0f/s), target %s\n", client.requests,
+	   opt.non ? "NON" : "CON", client.requests / seconds,
+	   opt.rate ? "open loop" : "closed loop");
+    printf("responses       %lu (%.0f/s)\n", client.responses,
+	   client.responses / seconds);
+    printf("lost            %lu (%.3f%%), late %lu, throttled %lu\n",
+	   client.timeouts, client.requests
+	   ? 100.0 * client.timeouts / client.requests : 0.0,
+	   client.late, client.throttled);
+    printf("injected        %lu duplicates, %lu malformed, %lu other replies\n",
+	   client.duplicates, client.malformed, client.other);
+    printf("latency us      p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f\n",
+	   lg_us(&client.latency, 0.5), lg_us(&client.latency, 0.9),
+	   lg_us(&client.latency, 0.99), lg_us(&client.latency, 0.999));
+  }
+
+  if (opt.observers) {
+    for (i = 0; i < opt.observers; i++) {
+      registered += client.obs[i].confirmed;
+      expected += server.sent[i];
+      if (server.sent[i] > client.obs[i].received)
+	lost += server.sent[i] - client.obs[i].received;
+    }
+    printf("observers       %u of %u registered, %lu at the end\n",
+	   registered, opt.observers, (unsigned long)server.registrations);
+    printf("notifications   %lu (%.0f/s), %lu duplicates\n",
+	   client.notifications, client.notifications / seconds,
+	   client.notify_dups);
+    printf("lost            %llu of %llu (%.3f%%), %lu held back\n",
+	   lost, expected, expected ? 100.0 * lost / expected : 0.0,
+	   server.deferred);
+    printf("CON replies     %lu ACK, %lu RST, %lu ignored\n",
+	   client.acks, client.rsts, client.ignored);
+    printf("latency us      p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f\n",
+	   lg_us(&client.notify_latency, 0.5),
+	   lg_us(&client.notify_latency, 0.9),
+	   lg_us(&client.notify_latency, 0.99),
+	   lg_us(&client.notify_latency, 0.999));
+  }
+
+  printf("server cpu      %.2f s (%.1f%%), %.2f us per message received\n",
+	 server.cpu, 100.0 * server.cpu / seconds,
+	 in ? server.cpu * 1e6 / in : 0.0);
+  printf("server counters %llu in, %llu retransmissions, %llu duplicates, "
+	 "%llu notifications, %llu expired\n", in,
+	 (unsigned long long)m->counter[COAP_METRIC_RETRANSMIT],
+	 (unsigned long long)m->counter[COAP_METRIC_DUPLICATE],
+	 (unsigned long long)m->counter[COAP_METRIC_NOTIFY],
+	 (unsigned long long)m->counter[COAP_METRIC_EXPIRED]);
+  printf("server stages   ");
+  for (i = 0; i < COAP_LATENCY_MAX; i++)
+    printf("%s p99 %.1f us%s", coap_latency_name(i),
+	   coap_latency_percentile(server.ctx, i, 0.99) / 1000.0,
+	   i + 1 < COAP_LATENCY_MAX ? ", " : "\n");
+}
+
+static void
+usage(const char *program) {
+  fprintf(stderr,
+	  "usage: %s [options]\n"
+	  "\t-d secs   duration (default 10)\n"
+	  "requests:\n"
+	  "\t-r rate   requests per second, 0 for closed loop (default 0)\n"
+	  "\t-w n      outstanding requests, 0 for none (default 64)\n"
+	  "\t-s n      sockets sending requests (default 8)\n"
+	  "\t-N        send NON instead of CON requests\n"
+	  "\t-T ms     request timeout (default 2000)\n"
+	  "\t-D frac   fraction of duplicated requests (default 0)\n"
+	  "\t-M frac   fraction of malformed requests (default 0)\n"
+	  "observers:\n"
+	  "\t-o n      observers, one socket each (default 0)\n"
+	  "\t-R n      observable resources (default 1)\n"
+	  "\t-f rate   notifications per second and resource (default 10)\n"
+	  "\t-c frac   fraction of CON notifications (default 0.1)\n"
+	  "\t-a prob   probability of acknowledging a CON (default 1)\n"
+	  "\t-x prob   probability of rejecting a CON with RST (default 0)\n"
+	  "\t-l ms     ACK delay (default 0)\n"
+	  "\t-q query  Uri-Query of the registrations, e.g. pmin=1\n"
+	  "\t-P bytes  notification payload (default 16)\n", program);
+}
+
+int
+main(int argc, char **argv) {
+  struct rlimit rl;
+  pthread_t thread;
+  unsigned long long start;
+  double seconds;
+  int c;
+
+  while ((c = getopt(argc, argv, "d:r:w:s:NT:D:M:o:R:f:c:a:x:l:q:P:h")) != -1) {
+    switch (c) {
+    case 'd': opt.duration = atof(optarg); break;
+    case 'r': opt.rate = strtoul(optarg, NULL, 10); break;
+    case 'w': opt.window = strtoul(optarg, NULL, 10); break;
+    case 's': opt.sockets = strtoul(optarg, NULL, 10); break;
+    case 'N': opt.non = 1; break;
+    case 'T': opt.timeout = strtoul(optarg, NULL, 10); break;
+    case 'D': opt.dup = atof(optarg); break;
+    case 'M': opt.malformed = atof(optarg); break;
+    case 'o': opt.observers = strtoul(optarg, NULL, 10); break;
+    case 'R': opt.resources = strtoul(optarg, NULL, 10); break;
+    case 'f': opt.notify_rate = atof(optarg); break;
+    case 'c': opt.con = atof(optarg); break;
+    case 'a': opt.ack = atof(optarg); break;
+    case 'x': opt.rst = atof(optarg); break;
+    case 'l': opt.ack_delay = strtoul(optarg, NULL, 10); break;
+    case 'q': opt.query = optarg; break;
+    case 'P': opt.payload = strtoul(optarg, NULL, 10); break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (opt.window > 0xffff)
+    opt.window = 0xffff;	/* slot numbers are 16 bits of the token */
+  if (!opt.sockets)
+    opt.sockets = 1;
+  if (!opt.resources)
+    opt.resources = 1;
+
+  /* every observer needs a socket */
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  coap_set_log_level(LOG_CRIT);
+
+  if (!lg_server_init() || !lg_client_init()) {
+    fprintf(stderr, "setup failed\n");
+    return EXIT_FAILURE;
+  }
+
+  if (pthread_create(&thread, NULL, lg_server_main, NULL) != 0) {
+    perror("pthread_create");
+    return EXIT_FAILURE;
+  }
+
+  start = lg_ns();
+  lg_client_run();
+  seconds = (lg_ns() - start) / 1e9;
+
+  server.stop = 1;
+  pthread_join(thread, NULL);
+
+  lg_report(seconds);
+  return EXIT_SUCCESS;
+}
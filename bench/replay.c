@@ -0,0 +1,557 @@
+/* replay.c -- replays captured requests through the stack
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file replay.c
+ * @brief replays captured requests through the stack
+ *
+ * Feeds the datagrams of a capture to a context through a memory
+ * transport as fast as coap_read() and coap_dispatch() take them, so
+ * the throughput measured is that of the stack alone, without the
+ * kernel or the network. Every path requested in the capture gets a
+ * resource that answers with 2.05; responses are counted and
+ * dropped.
+ *
+ * Captures are read in pcap format (Ethernet, Linux cooked, raw IP or
+ * BSD loopback, IPv4 or IPv6), of which the UDP datagrams to the
+ * server port are used, or in the binary format below, which -w
+ * writes so that captures can be trimmed once and loaded fast.
+ *
+ * Binary captures start with the four bytes "CCAP", followed by one
+ * record per datagram, all in network byte order:
+ *
+ *   family     1 byte, 4 or 6
+ *   reserved   1 byte
+ *   port       2 bytes, source port
+ *   address    4 or 16 bytes, source address
+ *   length     2 bytes
+ *   datagram   length bytes
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "coap.h"
+#include "metrics.h"
+#include "transport.h"
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NS   0xa1b23c4d
+
+#define LINKTYPE_NULL       0
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LINUX_SLL  113
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_IPV6       229
+#define LINKTYPE_LINUX_SLL2 276
+
+typedef struct {
+  coap_address_t src;
+  size_t length;
+  unsigned char *data;
+} record_t;
+
+static record_t *records;
+static size_t nrecords, maxrecords;
+
+static unsigned short port = COAP_DEFAULT_PORT;
+
+static void
+add_record(const coap_address_t *src, const unsigned char *data, size_t len) {
+  record_t *r;
+
+  if (len < sizeof(coap_hdr_t) || len > COAP_MAX_PDU_SIZE)
+    return;
+
+  if (nrecords == maxrecords) {
+    maxrecords = maxrecords ? 2 * maxrecords : 1024;
+    records = (record_t *)realloc(records, maxrecords * sizeof(record_t));
+    if (!records) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  r = &records[nrecords];
+  r->data = (unsigned char *)malloc(len);
+  if (!r->data) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&r->src, src, sizeof(coap_address_t));
+  memcpy(r->data, data, len);
+  r->length = len;
+  nrecords++;
+}
+
+static unsigned int
+get16(const unsigned char *p) {
+  return p[0] << 8 | p[1];
+}
+
+/* Adds the UDP datagram in the IP packet p of len bytes if it goes
+ * to the server port. */
+static void
+add_ip(const unsigned char *p, size_t len) {
+  coap_address_t src;
+  const unsigned char *udp;
+  size_t hlen, ulen;
+
+  coap_address_init(&src);
+  if (len < 1)
+    return;
+
+  switch (p[0] >> 4) {
+  case 4:
+    hlen = (p[0] & 0x0f) * 4;
+    if (len < hlen + 8 || hlen < 20 || p[9] != IPPROTO_UDP
+	|| (get16(p + 6) & 0x3fff))	/* fragment */
+      return;
+    src.addr.sin.sin_family = AF_INET;
+    memcpy(&src.addr.sin.sin_addr, p + 12, 4);
+    src.size = sizeof(struct sockaddr_in);
+    break;
+  case 6:
+    hlen = 40;
+    if (len < hlen + 8 || p[6] != IPPROTO_UDP)
+      return;
+    src.addr.sin6.sin6_family = AF_INET6;
+    memcpy(&src.addr.sin6.sin6_addr, p + 8, 16);
+    src.size = sizeof(struct sockaddr_in6);
+    break;
+  default:
+    return;
+  }
+
+  udp = p + hlen;
+  ulen = get16(udp + 4);
+  if (get16(udp + 2) != port || ulen < 8 || ulen > len - hlen)
+    return;
+
+  /* sin_port and sin6_port are at the same offset */
+  src.addr.sin.sin_port = htons(get16(udp));
+  add_record(&src, udp + 8, ulen - 8);
+}
+
+static unsigned int
+pcap32(const unsigned char *p, int swap) {
+  return swap ? (unsigned int)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0]
+    : (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int
+load_pcap(FILE *f, const unsigned char *header) {
+  unsigned char rec[16], *buf;
+  unsigned int magic, linktype, caplen, ether, off;
+  int swap;
+
+  magic = pcap32(header, 0);
+  swap = magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS;
+  linktype = pcap32(header + 20, swap) & 0xffff;
+
+  buf = (unsigned char *)malloc(0x40000);
+  if (!buf)
+    return 0;
+
+  while (fread(rec, sizeof(rec), 1, f) == 1) {
+    caplen = pcap32(rec + 8, swap);
+    if (caplen > 0x40000 || fread(buf, caplen, 1, f) != 1)
+      break;
+
+    switch (linktype) {
+    case LINKTYPE_NULL:
+      if (caplen > 4)
+	add_ip(buf + 4, caplen - 4);
+      break;
+    case LINKTYPE_ETHERNET:
+      off = 12;
+      if (caplen < off + 2)
+	break;
+      ether = get16(buf + off);
+      while ((ether == 0x8100 || ether == 0x88a8) && caplen >= off + 6) {
+	off += 4;		/* VLAN tag */
+	ether = get16(buf + off);
+      }
+      off += 2;
+      if (ether == 0x0800 || ether == 0x86dd)
+	add_ip(buf + off, caplen - off);
+      break;
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+      add_ip(buf, caplen);
+      break;
+    case LINKTYPE_LINUX_SLL:
+      if (caplen > 16)
+	add_ip(buf + 16, caplen - 16);
+      break;
+    case LINKTYPE_LINUX_SLL2:
+      if (caplen > 20)
+	add_ip(buf + 20, caplen - 20);
+      break;
+    default:
+      fprintf(stderr, "unsupported link type %u\n", linktype);
+      free(buf);
+      return 0;
+    }
+  }
+
+  free(buf);
+  return 1;
+}
+
+static int
+load_binary(FILE *f) {
+  unsigned char head[4], addr[16], buf[0x10000];
+  coap_address_t src;
+  size_t alen, len;
+
+  while (fread(head, sizeof(head), 1, f) == 1) {
+    alen = head[0] == 6 ? 16 : 4;
+    if (fread(addr, alen, 1, f) != 1 || fread(buf, 2, 1, f) != 1)
+      return 0;
+    len = get16(buf);
+    if (len && fread(buf, len, 1, f) != 1)
+      return 0;
+
+    coap_address_init(&src);
+    if (alen == 16) {
+      src.addr.sin6.sin6_family = AF_INET6;
+      memcpy(&src.addr.sin6.sin6_addr, addr, 16);
+      src.size = sizeof(struct sockaddr_in6);
+    } else {
+      src.addr.sin.sin_family = AF_INET;
+      memcpy(&src.addr.sin.sin_addr, addr, 4);
+      src.size = sizeof(struct sockaddr_in);
+    }
+    memcpy(&src.addr.sin.sin_port, head + 2, 2);
+    add_record(&src, buf, len);
+  }
+  return 1;
+}
+
+static int
+load(const char *name) {
+  unsigned char header[24];
+  unsigned int magic;
+  FILE *f;
+  int ok = 0;
+
+  f = fopen(name, "rb");
+  if (!f) {
+    perror(name);
+    return 0;
+  }
+
+  if (fread(header, 4, 1, f) == 1) {
+    magic = pcap32(header, 0);
+    if (memcmp(header, "CCAP", 4) == 0)
+      ok = load_binary(f);
+    else if ((magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS
+	      || pcap32(header, 1) == PCAP_MAGIC
+	      || pcap32(header, 1) == PCAP_MAGIC_NS)
+	     && fread(header + 4, 20, 1, f) == 1)
+      ok = load_pcap(f, header);
+    else
+      fprintf(stderr, "%s: unknown capture format\n", name);
+  }
+
+  fclose(f);
+  return ok;
+}
+
+static int
+save(const char *name) {
+  unsigned char head[4];
+  record_t *r;
+  size_t i;
+  FILE *f;
+
+  f = fopen(name, "wb");
+  if (!f) {
+    perror(name);
+    return 0;
+  }
+
+  fwrite("CCAP", 4, 1, f);
+  for (i = 0; i < nrecords; i++) {
+    r = &records[i];
+    head[0] = r->src.addr.sa.sa_family == AF_INET6 ? 6 : 4;
+    head[1] = 0;
+    memcpy(head + 2, &r->src.addr.sin.sin_port, 2);
+    fwrite(head, sizeof(head), 1, f);
+    if (head[0] == 6)
+      fwrite(&r->src.addr.sin6.sin6_addr, 16, 1, f);
+    else
+      fwrite(&r->src.addr.sin.sin_addr, 4, 1, f);
+    head[0] = r->length >> 8;
+    head[1] = r->length & 0xff;
+    fwrite(head, 2, 1, f);
+    fwrite(r->data, r->length, 1, f);
+  }
+
+  return fclose(f) == 0;
+}
+
+/* Creates count GET requests for "load" from sources clients. */
+static void
+generate(size_t count, unsigned int clients) {
+  coap_address_t src;
+  coap_pdu_t *pdu;
+  unsigned char token[4];
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    pdu = coap_pdu_init(COAP_MESSAGE_CON, COAP_REQUEST_GET,
+			htons((unsigned short)(i / clients)), 64);
+    if (!pdu)
+      break;
+    memcpy(token, &i, sizeof(token));
+    coap_add_option(pdu, COAP_OPTION_URI_PATH, 4, (unsigned char *)"load");
+    coap_add_option(pdu, COAP_OPTION_TOKEN, sizeof(token), token);
+
+    coap_address_init(&src);
+    src.addr.sin.sin_family = AF_INET;
+    src.addr.sin.sin_addr.s_addr = htonl(0x0a000000 + i % clients);
+    src.addr.sin.sin_port = htons(40000 + i % clients);
+    src.size = sizeof(struct sockaddr_in);
+    add_record(&src, (unsigned char *)pdu->hdr, pdu->length);
+    coap_delete_pdu(pdu);
+  }
+}
+
+static void
+hnd_any(coap_context_t *ctx, struct coap_resource_t *resource,
+	coap_address_t *peer, coap_pdu_t *request, str *token,
+	coap_pdu_t *response) {
+  (void)ctx;
+  (void)resource;
+  (void)peer;
+  (void)request;
+
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  if (token->length)
+    coap_add_option(response, COAP_OPTION_TOKEN, token->length, token->s);
+  coap_add_data(response, 2, (unsigned char *)"ok");
+}
+
+/* Wraps a record for the option functions. */
+static void
+wrap(record_t *r, coap_pdu_t *pdu) {
+  memset(pdu, 0, sizeof(coap_pdu_t));
+  pdu->hdr = (coap_hdr_t *)r->data;
+  pdu->length = r->length;
+  pdu->max_size = r->length;
+}
+
+/* Adds a resource for every path requested in the capture. */
+static size_t
+add_resources(coap_context_t *ctx) {
+  coap_opt_iterator_t oi;
+  coap_opt_filter_t filter;
+  coap_resource_t *res;
+  coap_pdu_t pdu;
+  coap_key_t key;
+  unsigned char *uri;
+  size_t i, len, added = 0;
+  int m;
+
+  coap_option_filter_clear(filter);
+  coap_option_setb(filter, COAP_OPTION_URI_PATH);
+
+  for (i = 0; i < nrecords; i++) {
+    wrap(&records[i], &pdu);
+    if (!COAP_MESSAGE_IS_REQUEST(pdu.hdr) || pdu.hdr->version != COAP_DEFAULT_VERSION)
+      continue;
+
+    coap_hash_request_uri(&pdu, key);
+    if (coap_get_resource_from_key(ctx, key))
+      continue;
+
+    uri = (unsigned char *)malloc(COAP_MAX_PDU_SIZE);
+    if (!uri)
+      break;
+    len = 0;
+    coap_option_iterator_init(&pdu, &oi, filter);
+    while (coap_option_next(&oi) && oi.type == COAP_OPTION_URI_PATH) {
+      if (len)
+	uri[len++] = '/';
+      memcpy(uri + len, COAP_OPT_VALUE(oi.option), COAP_OPT_LENGTH(oi.option));
+      len += COAP_OPT_LENGTH(oi.option);
+    }
+
+    res = coap_resource_init(uri, len, COAP_RESOURCE_FLAGS_RELEASE_URI);
+    if (!res)
+      break;
+    /* the key of the request, even if a segment has a '/' in it */
+    memcpy(res->key, key, sizeof(coap_key_t));
+    for (m = COAP_REQUEST_GET; m <= COAP_REQUEST_DELETE; m++)
+      coap_register_handler(res, m, hnd_any);
+    coap_add_resource(ctx, res);
+    added++;
+  }
+  return added;
+}
+
+static unsigned long long
+now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+usage(const char *program) {
+  fprintf(stderr,
+	  "usage: %s [options] [capture]\n"
+	  "\t-g n      replay n generated GET requests instead of a capture\n"
+	  "\t-c n      clients of the generated requests (default 16)\n"
+	  "\t-p port   server port in pcap captures (default %u)\n"
+	  "\t-n n      passes over the capture (default 1)\n"
+	  "\t-b n      datagrams read per dispatch (default 64)\n"
+	  "\t-k        keep the message ids, so later passes are duplicates\n"
+	  "\t-w file   write the datagrams as binary capture and exit\n",
+	  program, COAP_DEFAULT_PORT);
+}
+
+int
+main(int argc, char **argv) {
+  coap_address_t addr;
+  coap_context_t *ctx;
+  coap_transport_t *transport;
+  coap_metrics_t metrics;
+  unsigned long long start, elapsed, bytes, in = 0, fed = 0;
+  unsigned long sent;
+  unsigned int pass, passes = 1, batch = 64, clients = 16, i;
+  unsigned short mid = 0, id;
+  size_t n, generated = 0;
+  const char *output = NULL;
+  record_t *r;
+  int keep = 0, c;
+
+  while ((c = getopt(argc, argv, "g:c:p:n:b:kw:h")) != -1) {
+    switch (c) {
+    case 'g': generated = strtoul(optarg, NULL, 10); break;
+    case 'c': clients = strtoul(optarg, NULL, 10); break;
+    case 'p': port = strtoul(optarg, NULL, 10); break;
+    case 'n': passes = strtoul(optarg, NULL, 10); break;
+    case 'b': batch = strtoul(optarg, NULL, 10); break;
+    case 'k': keep = 1; break;
+    case 'w': output = optarg; break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (!clients)
+    clients = 1;
+  if (!batch)
+    batch = 1;
+
+  if (generated)
+    generate(generated, clients);
+  else if (optind < argc) {
+    if (!load(argv[optind]))
+      return EXIT_FAILURE;
+  } else {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!nrecords) {
+    fprintf(stderr, "no datagrams to port %u\n", port);
+    return EXIT_FAILURE;
+  }
+
+  if (output)
+    return save(output) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  coap_set_log_level(LOG_CRIT);
+
+  /* the socket is only opened, all traffic goes through transport */
+  coap_address_init(&addr);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.size = sizeof(addr.addr.sin);
+  ctx = coap_new_context(&addr);
+  transport = coap_memory_transport_new(batch, 0);
+  if (!ctx || !transport) {
+    fprintf(stderr, "setup failed\n");
+    return EXIT_FAILURE;
+  }
+  coap_set_transport(ctx, transport);
+
+  printf("datagrams       %lu, %lu resources\n", (unsigned long)nrecords,
+	 (unsigned long)add_resources(ctx));
+
+  start = now_ns();
+  for (pass = 0; pass < passes; pass++) {
+    for (n = 0; n < nrecords; n++) {
+      r = &records[n];
+
+      /* fresh message ids unless asked otherwise, so that later
+       * passes are not taken for duplicates (until the 16 bits of
+       * the id wrap around) */
+      if (!keep && r->length >= 4
+	  && (r->data[0] >> 4 & 0x03) <= COAP_MESSAGE_NON) {
+	id = htons(mid++);
+	memcpy(r->data + 2, &id, 2);
+      }
+
+      if (!coap_memory_transport_push(transport, &r->src, r->data, r->length)) {
+	while (coap_memory_transport_pending(transport))
+	  coap_read(ctx);
+	coap_dispatch(ctx);
+	coap_memory_transport_push(transport, &r->src, r->data, r->length);
+      }
+      fed++;
+    }
+  }
+  while (coap_memory_transport_pending(transport))
+    coap_read(ctx);
+  coap_dispatch(ctx);
+  elapsed = now_ns() - start;
+
+  sent = coap_memory_transport_sent(transport, &bytes);
+  coap_metrics_snapshot(ctx, &metrics);
+  for (i = COAP_METRIC_IN_CON; i <= COAP_METRIC_IN_RST; i++)
+    in += metrics.counter[i];
+
+  printf("passes          %u, %llu datagrams fed, %llu accepted\n",
+	 passes, fed, in);
+  printf("elapsed         %.3f s, %.0f ns per datagram, %.0f datagrams/s\n",
+	 elapsed / 1e9, (double)elapsed / fed, fed * 1e9 / elapsed);
+  printf("sent            %lu datagrams, %llu bytes\n", sent, bytes);
+  printf("duplicates      %llu\n",
+	 (unsigned long long)metrics.counter[COAP_METRIC_DUPLICATE]);
+  printf("stages ns       ");
+  for (i = 0; i < COAP_LATENCY_MAX; i++)
+    if (i != COAP_LATENCY_ACK)
+      printf("%s p50 %llu p99 %llu%s", coap_latency_name(i),
+	     (unsigned long long)coap_latency_percentile(ctx, i, 0.5),
+	     (unsigned long long)coap_latency_percentile(ctx, i, 0.99),
+	     i + 1 < COAP_LATENCY_ACK ? ", " : "");
+  printf("\n");
+
+  coap_set_transport(ctx, NULL);
+  coap_free_transport(transport);
+  coap_free_context(ctx);
+  for (n = 0; n < nrecords; n++)
+    free(records[n].data);
+  free(records);
+  return EXIT_SUCCESS;
+}
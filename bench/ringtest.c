@@ -0,0 +1,154 @@
+/* ringtest.c -- checks the descriptor ring across two threads
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file ringtest.c
+ * @brief checks the descriptor ring across two threads
+ *
+ * A producer thread pushes the numbers 1 to @c ITEMS into a small
+ * ring, one by one and in batches, pausing now and then so that the
+ * consumer runs dry and goes to sleep on coap_ring_fd(). The last
+ * @c PINGPONG numbers are pushed only once the consumer has taken the
+ * one before, so that each of them has to wake it up. The consumer
+ * checks that every number arrives once and in order. As the
+ * consumer only sleeps while numbers are missing, a sleep that ends
+ * by timeout means that a wakeup was lost between
+ * coap_ring_prepare_wait() and coap_ring_push(). Exits with @c EXIT_FAILURE on either error.
+ */
+
+#include "config.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ring.h"
+
+#define ITEMS      500000
+#define RING_SIZE  64
+#define BATCH      16
+#define PAUSE_EVERY 5000	/* items between pauses of the producer */
+#define PINGPONG   1000
+#define WAIT_MS    1000		/* longest sleep that is not a lost wakeup */
+
+static coap_ring_t *ring;
+static uintptr_t received;	/* last number taken by the consumer */
+static int stop;		/* set by the consumer when it gives up */
+
+/* Lets the producer wait for room or for the consumer. Returns 0 once
+ * the consumer has given up. */
+static int
+pass(void) {
+  if (__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    return 0;
+  sched_yield();
+  return 1;
+}
+
+static void *
+producer(void *arg) {
+  void *items[BATCH];
+  struct timespec pause = { 0, 100000 };
+  uintptr_t next = 1;
+  size_t n, i, sent;
+
+  (void)arg;
+
+  while (next <= ITEMS) {
+    if (next > ITEMS - PINGPONG) {
+      while (__atomic_load_n(&received, __ATOMIC_ACQUIRE) < next - 1)
+	if (!pass())
+	  return NULL;
+      coap_ring_put(ring, (void *)next++);
+      continue;
+    }
+
+    if (next % 2) {
+      while (!coap_ring_put(ring, (void *)next))
+	if (!pass())
+	  return NULL;
+      next++;
+    } else {
+      n = ITEMS - next + 1 < BATCH ? ITEMS - next + 1 : BATCH;
+      for (i = 0; i < n; i++)
+	items[i] = (void *)(next + i);
+      sent = coap_ring_push(ring, items, n);
+      while (sent < n) {
+	if (!pass())
+	  return NULL;
+	sent += coap_ring_push(ring, items + sent, n - sent);
+      }
+      next += n;
+    }
+
+    if (next % PAUSE_EVERY < BATCH)
+      nanosleep(&pause, NULL);
+  }
+
+  return NULL;
+}
+
+int
+main(void) {
+  pthread_t thread;
+  struct pollfd pfd;
+  void *items[BATCH];
+  uintptr_t expected = 1;
+  unsigned long sleeps = 0, lost = 0, wrong = 0;
+  size_t n, i;
+  int ok;
+
+  ring = coap_ring_new(RING_SIZE);
+  if (!ring || pthread_create(&thread, NULL, producer, NULL) != 0) {
+    fprintf(stderr, "setup failed\n");
+    return EXIT_FAILURE;
+  }
+
+  pfd.fd = coap_ring_fd(ring);
+  pfd.events = POLLIN;
+
+  while (expected <= ITEMS) {
+    n = coap_ring_pop(ring, items, BATCH);
+    for (i = 0; i < n; i++, expected++) {
+      if ((uintptr_t)items[i] != expected) {
+	wrong++;
+	expected = (uintptr_t)items[i];
+      }
+    }
+    if (n) {
+      __atomic_store_n(&received, expected - 1, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    if (!coap_ring_prepare_wait(ring)) {
+      if (pfd.fd < 0)
+	sched_yield();
+      continue;
+    }
+
+    sleeps++;
+    if (poll(&pfd, 1, WAIT_MS) == 0 && ++lost > 2) {
+      __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    coap_ring_finish_wait(ring);
+  }
+
+  pthread_join(thread, NULL);
+  coap_ring_free(ring);
+
+  ok = !wrong && !lost && expected == ITEMS + 1;
+
+  printf("items           %lu, %lu out of order\n",
+	 (unsigned long)(expected - 1), wrong);
+  printf("sleeps          %lu, %lu without wakeup\n", sleeps, lost);
+  printf("%s\n", ok ? "ok" : "FAIL");
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
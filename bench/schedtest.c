@@ -0,0 +1,180 @@
+/* schedtest.c -- checks the shares of the notification scheduler
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file schedtest.c
+ * @brief checks the shares of the notification scheduler
+ *
+ * Two observable resources of equal weight share a notification rate
+ * that is too small for both: @c fast has a new sample for each of
+ * its observers every millisecond, @c slow one every 100 ms, which
+ * needs less than half of the rate. Deficit round robin must give
+ * @c slow all it asks for and @c fast the rest, although the credit
+ * of each call to coap_check_notify() is smaller than a notification.
+ * The notifications go through a memory transport and are counted by
+ * destination. Exits with @c EXIT_FAILURE if a share is off.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "coap.h"
+#include "transport.h"
+
+#define RATE       20000	/* bytes per second */
+#define DURATION   2000		/* steps of one millisecond */
+#define OBSERVERS  4		/* per resource */
+#define SLOW_EVERY 100		/* steps between samples of slow */
+#define PAYLOAD    100
+
+#define FAST_PORT  41000
+#define SLOW_PORT  42000
+
+typedef struct {
+  coap_resource_t *resource;
+  coap_registration_t *reg[OBSERVERS];
+  unsigned long offered;	/* samples passed to coap_notify() */
+  unsigned long received;	/* notifications that left the context */
+} stream_t;
+
+static void
+add_stream(coap_context_t *ctx, stream_t *s, const char *uri,
+	   unsigned short port) {
+  coap_address_t addr;
+  unsigned char token[4];
+  str tok = { sizeof(token), token };
+  int i;
+
+  memset(s, 0, sizeof(stream_t));
+  s->resource = coap_resource_init((unsigned char *)uri, strlen(uri), 0);
+  s->resource->observable = 1;
+  coap_add_resource(ctx, s->resource);
+
+  for (i = 0; i < OBSERVERS; i++) {
+    coap_address_init(&addr);
+    addr.addr.sin.sin_family = AF_INET;
+    addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.addr.sin.sin_port = htons(port + i);
+    addr.size = sizeof(addr.addr.sin);
+
+    memcpy(token, &addr.addr.sin.sin_port, 2);
+    token[2] = token[3] = 0;
+    s->reg[i] = coap_registration_checkout(
+      coap_add_registration(s->resource, &addr, &tok));
+    s->reg[i]->non = 0;	/* plain NON, no CON every so often */
+  }
+}
+
+static void
+notify(coap_context_t *ctx, stream_t *s) {
+  static unsigned char payload[PAYLOAD];
+  coap_registration_t *reg;
+  coap_pdu_t *pdu;
+  int i;
+
+  for (i = 0; i < OBSERVERS; i++) {
+    reg = s->reg[i];
+    pdu = coap_pdu_init(COAP_MESSAGE_NON, COAP_RESPONSE_CODE(205),
+			coap_new_peer_message_id(ctx, &reg->subscriber),
+			COAP_MAX_PDU_SIZE);
+    if (!pdu)
+      continue;
+
+    coap_add_option(pdu, COAP_OPTION_TOKEN, reg->token_length, reg->token);
+    coap_add_data(pdu, sizeof(payload), payload);
+    coap_notify(ctx, pdu, reg);
+    s->offered++;
+  }
+}
+
+static void
+remove_stream(stream_t *s) {
+  int i;
+
+  for (i = 0; i < OBSERVERS; i++)
+    coap_registration_release(s->resource, s->reg[i]);
+}
+
+/* Counts the notifications sent since the last call by stream. */
+static void
+collect(coap_transport_t *transport, stream_t *fast, stream_t *slow) {
+  unsigned char buf[COAP_MAX_PDU_SIZE];
+  coap_address_t dst;
+  unsigned short port;
+
+  while (coap_memory_transport_pop(transport, &dst, buf, sizeof(buf)) >= 0) {
+    port = ntohs(dst.addr.sin.sin_port);
+    if (port >= FAST_PORT && port < FAST_PORT + OBSERVERS)
+      fast->received++;
+    else if (port >= SLOW_PORT && port < SLOW_PORT + OBSERVERS)
+      slow->received++;
+  }
+}
+
+int
+main(void) {
+  coap_context_t *ctx;
+  coap_transport_t *transport;
+  coap_address_t addr;
+  stream_t fast, slow;
+  struct timespec step = { 0, 1000000 };
+  unsigned long total;
+  int n, ok;
+
+  coap_set_log_level(LOG_CRIT);
+
+  coap_address_init(&addr);
+  addr.addr.sin.sin_family = AF_INET;
+  addr.addr.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.size = sizeof(addr.addr.sin);
+  ctx = coap_new_context(&addr);
+  transport = coap_memory_transport_new(4096, 1);
+  if (!ctx || !transport) {
+    fprintf(stderr, "setup failed\n");
+    return EXIT_FAILURE;
+  }
+  coap_set_transport(ctx, transport);
+
+  /* fast comes first in the resource table and in every round */
+  add_stream(ctx, &fast, "fast", FAST_PORT);
+  add_stream(ctx, &slow, "slow", SLOW_PORT);
+  coap_set_notify_rate(ctx, RATE);
+
+  for (n = 0; n < DURATION; n++) {
+    notify(ctx, &fast);
+    if (n % SLOW_EVERY == 0)
+      notify(ctx, &slow);
+    coap_check_notify(ctx);
+    collect(transport, &fast, &slow);
+    nanosleep(&step, NULL);
+  }
+
+  /* slow is below its half of the rate and must get nearly all it
+   * offered, fast must get at least what slow left of its half */
+  total = fast.received + slow.received;
+  ok = slow.received >= slow.offered * 8 / 10 &&
+    fast.received >= total * 4 / 10;
+
+  printf("fast            %lu of %lu notifications\n",
+	 fast.received, fast.offered);
+  printf("slow            %lu of %lu notifications\n",
+	 slow.received, slow.offered);
+  printf("%s\n", ok ? "ok" : "FAIL");
+
+  remove_stream(&fast);
+  remove_stream(&slow);
+  coap_set_transport(ctx, NULL);
+  coap_free_transport(transport);
+  coap_free_context(ctx);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
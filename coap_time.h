@@ -49,19 +49,59 @@ contiki_ticks_impl(coap_tick_t *t) {
 #define coap_ticks contiki_ticks_impl
 
 #else /* WITH_CONTIKI */
-typedef unsigned int coap_tick_t; 
+#include <stdint.h>
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+/**
+ * Nanoseconds of a monotonic clock. Ticks do not jump when the wall
+ * clock is set and do not wrap in practice.
+ */
+typedef uint64_t coap_tick_t; 
 
-#define COAP_TICKS_PER_SECOND 1024
+#define COAP_TICKS_PER_SECOND 1000000000ULL
 
-/** Set at startup to initialize the internal clock (time in seconds). */
+/** 
+ * Set at startup to initialize the internal clock: the wall clock
+ * time in seconds at which the tick counter was zero.
+ */
 extern time_t clock_offset;
 #endif
 
+#ifndef coap_ticks
+static inline void
+coap_ticks_impl(coap_tick_t *t) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  *t = (coap_tick_t)ts.tv_sec * COAP_TICKS_PER_SECOND + ts.tv_nsec;
+#elif defined(HAVE_SYS_TIME_H)
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  *t = (coap_tick_t)(tv.tv_sec - clock_offset) * COAP_TICKS_PER_SECOND 
+    + (coap_tick_t)tv.tv_usec * (COAP_TICKS_PER_SECOND / 1000000);
+#else
+#error "clock not implemented"
+#endif
+}
+#define coap_ticks coap_ticks_impl
+#endif /* coap_ticks */
+
 #ifndef coap_clock_init
 static inline void
 coap_clock_init_impl(void) {
 #ifdef HAVE_TIME_H
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  coap_tick_t now;
+  coap_ticks(&now);
+  clock_offset = time(NULL) - (time_t)(now / COAP_TICKS_PER_SECOND);
+#else
   clock_offset = time(NULL);
+#endif
 #else
 #warn "cannot initialize clock"
   clock_offset = 0;
@@ -70,21 +110,6 @@ coap_clock_init_impl(void) {
 #define coap_clock_init coap_clock_init_impl
 #endif /* coap_clock_init */
 
-#ifndef coap_ticks
-static inline void
-coap_ticks_impl(coap_tick_t *t) {
-#ifdef HAVE_SYS_TIME_H
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  *t = (tv.tv_sec - clock_offset) * COAP_TICKS_PER_SECOND 
-    + (tv.tv_usec * COAP_TICKS_PER_SECOND / 1000000);
-#else
-#error "clock not implemented"
-#endif
-}
-#define coap_ticks coap_ticks_impl
-#endif /* coap_ticks */
-
 /** @} */
 
 #endif /* _COAP_TIME_H_ */
@@ -10,6 +10,16 @@
 /* Define to 1 if you have the <assert.h> header file. */
 #define HAVE_ASSERT_H 1
 
+/* Define to 1 if you have the `clock_gettime' function. */
+#define HAVE_CLOCK_GETTIME 1
+
+/* Define to 1 if you have the `getrandom' function. Bionic only has it
+   from API level 28 on, older platforms read /dev/urandom instead. */
+#if !defined(__ANDROID__) || \
+    (defined(__ANDROID_API__) && __ANDROID_API__ >= 28)
+#define HAVE_GETRANDOM 1
+#endif
+
 /* Define to 1 if you have the `getaddrinfo' function. */
 #define HAVE_GETADDRINFO 1
 
@@ -65,6 +75,9 @@
 /* Define to 1 if you have the `strrchr' function. */
 #define HAVE_STRRCHR 1
 
+/* Define to 1 if you have the <sys/eventfd.h> header file. */
+#define HAVE_SYS_EVENTFD_H 1
+
 /* Define to 1 if you have the <sys/socket.h> header file. */
 #define HAVE_SYS_SOCKET_H 1
 
@@ -0,0 +1,241 @@
+/* metrics.c -- traffic and state metrics
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file metrics.c
+ * @brief traffic and state metrics
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "net.h"
+#include "resource.h"
+#include "asynchronous.h"
+#include "utlist.h"
+#include "metrics.h"
+
+__thread int coap_metrics_slot = -1;
+static int coap_metrics_next_slot;
+
+static const char *coap_metric_names[COAP_METRIC_MAX] = {
+  "out_con", "out_non", "out_ack", "out_rst",
+  "out_con_bytes", "out_non_bytes", "out_ack_bytes", "out_rst_bytes",
+  "in_con", "in_non", "in_ack", "in_rst",
+  "in_con_bytes", "in_non_bytes", "in_ack_bytes", "in_rst_bytes",
+  "retransmit", "duplicate", "notify", "expired"
+};
+
+static const char *coap_latency_names[COAP_LATENCY_MAX] = {
+  "queue", "handler", "send", "total", "ack"
+};
+
+int
+coap_metrics_assign_slot(void) {
+  coap_metrics_slot =
+    __atomic_fetch_add(&coap_metrics_next_slot, 1, __ATOMIC_RELAXED)
+    & (COAP_METRICS_SHARDS - 1);
+  return coap_metrics_slot;
+}
+
+const char *
+coap_metric_name(coap_metric_t metric) {
+  return metric < COAP_METRIC_MAX ? coap_metric_names[metric] : "?";
+}
+
+const char *
+coap_latency_name(coap_latency_t stage) {
+  return stage < COAP_LATENCY_MAX ? coap_latency_names[stage] : "?";
+}
+
+coap_tick_t
+coap_histogram_value(unsigned int bucket) {
+  unsigned int shift;
+  coap_tick_t base;
+
+  if (bucket < (1U << COAP_HISTOGRAM_SUB_BITS))
+    return bucket;
+
+  /* the sub-bucket with the implicit leading bit, see
+   * coap_histogram_bucket() */
+  shift = (bucket >> COAP_HISTOGRAM_SUB_BITS) - 1;
+  base = (bucket & ((1U << COAP_HISTOGRAM_SUB_BITS) - 1))
+    | (1U << COAP_HISTOGRAM_SUB_BITS);
+  return ((base + 1) << shift) - 1;
+}
+
+void
+coap_histogram_merge(coap_histogram_t *dst, const coap_histogram_t *src) {
+  unsigned int i;
+
+  dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+  dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+  for (i = 0; i < COAP_HISTOGRAM_BUCKETS; i++)
+    dst->bucket[i] += __atomic_load_n(&src->bucket[i], __ATOMIC_RELAXED);
+}
+
+coap_tick_t
+coap_histogram_percentile(const coap_histogram_t *hist, double q) {
+  uint64_t total = 0, rank, seen = 0;
+  unsigned int i;
+
+  if (!hist)
+    return 0;
+
+  /* count from the buckets, hist->count may run ahead of them */
+  for (i = 0; i < COAP_HISTOGRAM_BUCKETS; i++)
+    total += __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED);
+  if (!total)
+    return 0;
+
+  if (q < 0)
+    q = 0;
+  rank = (uint64_t)(q * total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > total)
+    rank = total;
+
+  for (i = 0; i < COAP_HISTOGRAM_BUCKETS; i++) {
+    seen += __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED);
+    if (seen >= rank)
+      return coap_histogram_value(i);
+  }
+  return coap_histogram_value(COAP_HISTOGRAM_BUCKETS - 1);
+}
+
+coap_tick_t
+coap_latency_percentile(coap_context_t *context, coap_latency_t stage,
+			double q) {
+  return stage < COAP_LATENCY_MAX 
+    ? coap_histogram_percentile(&context->latency[stage], q) : 0;
+}
+
+void
+coap_metrics_snapshot(coap_context_t *context, coap_metrics_t *metrics) {
+  coap_resource_t *r, *rtmp;
+  coap_registration_t *reg;
+  coap_queue_t *node;
+  coap_alive_mid_t *mid;
+  coap_peer_t *peer;
+  unsigned int i, m;
+
+  memset(metrics, 0, sizeof(coap_metrics_t));
+
+  for (i = 0; i < COAP_METRICS_SHARDS; i++)
+    for (m = 0; m < COAP_METRIC_MAX; m++)
+      metrics->counter[m] +=
+	__atomic_load_n(&context->metrics[i].counter[m], __ATOMIC_RELAXED);
+
+  LL_FOREACH(context->sendqueue, node)
+    metrics->sendqueue++;
+
+  for (i = 1; i < context->peers.size; i++) {
+    peer = context->peers.byid[i];
+    if (!peer)
+      continue;
+    metrics->inflight += peer->outstanding;
+    LL_FOREACH(peer->pending, node)
+      metrics->pending++;
+  }
+
+  HASH_ITER(hh, context->resources, r, rtmp) {
+    LL_FOREACH(r->subscribers, reg)
+      if (!reg->invalid)
+	metrics->registrations++;
+  }
+
+  for (mid = context->alive_mids; mid; mid = (coap_alive_mid_t *)mid->next)
+    metrics->dedup++;
+}
+
+void
+coap_resource_metrics(coap_resource_t *resource,
+		      coap_resource_metrics_t *metrics) {
+  coap_registration_t *reg;
+
+  metrics->requests = resource->requests;
+  metrics->notifications = resource->notifications;
+  metrics->notify_bytes = resource->notify_bytes;
+  metrics->registrations = 0;
+
+  /* live registrations still hold their own counts */
+  LL_FOREACH(resource->subscribers, reg) {
+    metrics->notifications += (unsigned int)reg->datapackcount;
+    metrics->notify_bytes += (unsigned int)reg->octcount;
+    if (!reg->invalid)
+      metrics->registrations++;
+  }
+}
+
+static void
+hnd_get_metrics(coap_context_t *context, struct coap_resource_t *resource,
+		coap_address_t *peer, coap_pdu_t *request, str *token,
+		coap_pdu_t *response) {
+  unsigned char buf[COAP_MAX_PDU_SIZE];
+  coap_metrics_t metrics;
+  size_t len = 0, room;
+  unsigned int m;
+  int n;
+  char name[32];
+
+  (void)resource;
+  (void)peer;
+  (void)request;
+
+  coap_metrics_snapshot(context, &metrics);
+
+  /* leave room for the header and the token */
+  room = sizeof(buf) - (response->data - (unsigned char *)response->hdr) - 16;
+
+#define coap_metrics_line(Name, Value)					\
+  do {									\
+    n = snprintf((char *)buf + len, room - len, "%s %llu\n",		\
+		 (Name), (unsigned long long)(Value));			\
+    if (n > 0 && (size_t)n < room - len)				\
+      len += n;								\
+  } while (0)
+
+  for (m = 0; m < COAP_METRIC_MAX; m++)
+    coap_metrics_line(coap_metric_name(m), metrics.counter[m]);
+  coap_metrics_line("sendqueue", metrics.sendqueue);
+  coap_metrics_line("inflight", metrics.inflight);
+  coap_metrics_line("pending", metrics.pending);
+  coap_metrics_line("registrations", metrics.registrations);
+  coap_metrics_line("dedup", metrics.dedup);
+
+  for (m = 0; m < COAP_LATENCY_MAX; m++) {
+    snprintf(name, sizeof(name), "%s_p50", coap_latency_name(m));
+    coap_metrics_line(name, coap_latency_percentile(context, m, 0.5));
+    snprintf(name, sizeof(name), "%s_p99", coap_latency_name(m));
+    coap_metrics_line(name, coap_latency_percentile(context, m, 0.99));
+    snprintf(name, sizeof(name), "%s_p999", coap_latency_name(m));
+    coap_metrics_line(name, coap_latency_percentile(context, m, 0.999));
+  }
+
+#undef coap_metrics_line
+
+  response->hdr->code = COAP_RESPONSE_CODE(205);
+  if (token && token->length)
+    coap_add_option(response, COAP_OPTION_TOKEN, token->length, token->s);
+  coap_add_data(response, len, buf);
+}
+
+coap_resource_t *
+coap_metrics_resource(coap_context_t *context,
+		      const unsigned char *uri, size_t len) {
+  coap_resource_t *r;
+
+  r = coap_resource_init(uri, len, 0);
+  if (!r)
+    return NULL;
+
+  coap_register_handler(r, COAP_REQUEST_GET, hnd_get_metrics);
+  coap_add_resource(context, r);
+  return r;
+}
@@ -0,0 +1,250 @@
+/* metrics.h -- traffic and state metrics
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file metrics.h
+ * @brief traffic and state metrics
+ */
+
+#ifndef _COAP_METRICS_H_
+#define _COAP_METRICS_H_
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "coap_time.h"
+#include "ring.h"
+
+/**
+ * @defgroup metrics Metrics
+ * @{
+ * Every context counts its traffic in a registry of counters. Each
+ * thread updates a shard of its own, on a separate cache line, and
+ * coap_metrics_snapshot() merges the shards when the counters are
+ * read. The snapshot also samples gauges of the context state.
+ *
+ * Latencies are recorded in log-bucketed histograms: values are
+ * grouped by their highest set bit, and each power of two is split
+ * into 2^COAP_HISTOGRAM_SUB_BITS linear sub-buckets, so the relative
+ * error of a percentile stays below 1/2^COAP_HISTOGRAM_SUB_BITS at
+ * any magnitude. Recording a value is one bit scan and three relaxed
+ * atomic adds, for the bucket, the count and the sum.
+ */
+
+#ifndef COAP_METRICS_SHARDS
+/**
+ * Number of counter shards per context, a power of two. Threads
+ * beyond this number share shards, which is still correct.
+ */
+#define COAP_METRICS_SHARDS 8
+#endif /* COAP_METRICS_SHARDS */
+
+/**
+ * Counters. Message counters come in groups of four, indexed by
+ * message type (CON, NON, ACK, RST), so that e.g. @c
+ * COAP_METRIC_OUT_CON + type counts sent messages of that type.
+ */
+typedef enum {
+  COAP_METRIC_OUT_CON = 0,	/**< messages sent */
+  COAP_METRIC_OUT_NON,
+  COAP_METRIC_OUT_ACK,
+  COAP_METRIC_OUT_RST,
+  COAP_METRIC_OUT_CON_BYTES,	/**< bytes sent */
+  COAP_METRIC_OUT_NON_BYTES,
+  COAP_METRIC_OUT_ACK_BYTES,
+  COAP_METRIC_OUT_RST_BYTES,
+  COAP_METRIC_IN_CON,		/**< messages received */
+  COAP_METRIC_IN_NON,
+  COAP_METRIC_IN_ACK,
+  COAP_METRIC_IN_RST,
+  COAP_METRIC_IN_CON_BYTES,	/**< bytes received */
+  COAP_METRIC_IN_NON_BYTES,
+  COAP_METRIC_IN_ACK_BYTES,
+  COAP_METRIC_IN_RST_BYTES,
+  COAP_METRIC_RETRANSMIT,	/**< retransmissions */
+  COAP_METRIC_DUPLICATE,	/**< duplicate requests received */
+  COAP_METRIC_NOTIFY,		/**< notifications sent */
+  COAP_METRIC_EXPIRED,		/**< notifications dropped as stale */
+  COAP_METRIC_MAX
+} coap_metric_t;
+
+/**
+ * One shard of the counters of a context, padded to whole cache lines
+ * so that threads do not write to the same line. (The context itself
+ * comes from coap_malloc(), which does not promise cache line
+ * alignment, so the padding is used instead of an aligned type.)
+ */
+typedef struct {
+  uint64_t counter[COAP_METRIC_MAX];
+  unsigned char pad[COAP_CACHELINE_SIZE 
+		    - COAP_METRIC_MAX * sizeof(uint64_t) % COAP_CACHELINE_SIZE];
+} coap_metrics_shard_t;
+
+#ifndef COAP_HISTOGRAM_SUB_BITS
+/** log2 of the number of sub-buckets per power of two. */
+#define COAP_HISTOGRAM_SUB_BITS 4
+#endif /* COAP_HISTOGRAM_SUB_BITS */
+
+#ifndef COAP_HISTOGRAM_MAX_BITS
+/** Values of 2^COAP_HISTOGRAM_MAX_BITS ticks and more are counted in
+ *  the last bucket. 2^40 ns are about 18 minutes. */
+#define COAP_HISTOGRAM_MAX_BITS 40
+#endif /* COAP_HISTOGRAM_MAX_BITS */
+
+/** Number of buckets of a histogram. */
+#define COAP_HISTOGRAM_BUCKETS						\
+  ((COAP_HISTOGRAM_MAX_BITS - COAP_HISTOGRAM_SUB_BITS + 1)		\
+   << COAP_HISTOGRAM_SUB_BITS)
+
+/** A histogram of durations in ticks. */
+typedef struct coap_histogram_t {
+  uint64_t count;		/**< number of values recorded */
+  uint64_t sum;			/**< sum of the values recorded */
+  unsigned int bucket[COAP_HISTOGRAM_BUCKETS];
+} coap_histogram_t;
+
+/** The stages of the packet path that latencies are recorded for. */
+typedef enum {
+  COAP_LATENCY_QUEUE = 0,	/**< coap_read() until coap_dispatch() */
+  COAP_LATENCY_HANDLER,		/**< the resource handler */
+  COAP_LATENCY_SEND,		/**< the send function of the transport */
+  COAP_LATENCY_TOTAL,		/**< coap_read() until the message is done */
+  COAP_LATENCY_ACK,		/**< first transmission of a CON until its ACK */
+  COAP_LATENCY_MAX
+} coap_latency_t;
+
+/** Returns the bucket of histograms that @p value is counted in. */
+static inline unsigned int
+coap_histogram_bucket(coap_tick_t value) {
+  unsigned int shift;
+
+  if (value < (1U << COAP_HISTOGRAM_SUB_BITS))
+    return value;
+  if (value >> COAP_HISTOGRAM_MAX_BITS)
+    return COAP_HISTOGRAM_BUCKETS - 1;
+
+  shift = 63 - __builtin_clzll(value) - COAP_HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << COAP_HISTOGRAM_SUB_BITS)
+    + ((value >> shift) & ((1U << COAP_HISTOGRAM_SUB_BITS) - 1));
+}
+
+/** Records @p value in @p hist. Safe to call from several threads. */
+static inline void
+coap_histogram_add(coap_histogram_t *hist, coap_tick_t value) {
+  __atomic_fetch_add(&hist->bucket[coap_histogram_bucket(value)], 1,
+		     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records @p Ticks for stage @p Stage of context @p Ctx.
+ *
+ * @hideinitializer
+ */
+#define coap_latency_add(Ctx, Stage, Ticks)				\
+  coap_histogram_add(&(Ctx)->latency[(Stage)], (Ticks))
+
+/** Merged counters and gauges of a context, see coap_metrics_snapshot(). */
+typedef struct {
+  uint64_t counter[COAP_METRIC_MAX];
+
+  size_t sendqueue;		/**< nodes in the sendqueue, timers included */
+  size_t inflight;		/**< confirmable messages not acknowledged yet */
+  size_t pending;		/**< confirmable messages waiting for NSTART */
+  size_t registrations;		/**< valid registrations */
+  size_t dedup;			/**< duplicate detection records */
+} coap_metrics_t;
+
+/** Per-resource counters, see coap_resource_metrics(). */
+typedef struct {
+  uint64_t requests;		/**< requests handled */
+  uint64_t notifications;	/**< data notifications sent */
+  uint64_t notify_bytes;	/**< payload bytes of the notifications */
+  size_t registrations;		/**< valid registrations */
+} coap_resource_metrics_t;
+
+/** The shard index of the calling thread, -1 until assigned. */
+extern __thread int coap_metrics_slot;
+
+/** Assigns a shard index to the calling thread and returns it. */
+int coap_metrics_assign_slot(void);
+
+static inline int
+coap_metrics_shard(void) {
+  return coap_metrics_slot >= 0 ? coap_metrics_slot : coap_metrics_assign_slot();
+}
+
+/**
+ * Adds @p N to counter @p Metric of context @p Ctx.
+ *
+ * @hideinitializer
+ */
+#define coap_metric_add(Ctx, Metric, N)					\
+  __atomic_fetch_add(							\
+    &(Ctx)->metrics[coap_metrics_shard()].counter[(Metric)],		\
+    (N), __ATOMIC_RELAXED)
+
+struct coap_context_t;
+struct coap_resource_t;
+
+/**
+ * Merges the counters of all shards of @p context and samples its
+ * gauges into @p metrics. The gauges walk the sendqueue, the peers
+ * and the registrations, so this is meant for monitoring, not for
+ * the packet path.
+ */
+void coap_metrics_snapshot(struct coap_context_t *context,
+			   coap_metrics_t *metrics);
+
+/** Reads the counters of @p resource into @p metrics. */
+void coap_resource_metrics(struct coap_resource_t *resource,
+			   coap_resource_metrics_t *metrics);
+
+/** Returns the name of counter @p metric. */
+const char *coap_metric_name(coap_metric_t metric);
+
+/** Returns the largest value counted in bucket @p bucket. */
+coap_tick_t coap_histogram_value(unsigned int bucket);
+
+/** Adds the counts of @p src to @p dst. */
+void coap_histogram_merge(coap_histogram_t *dst, const coap_histogram_t *src);
+
+/**
+ * Returns the value below which the fraction @p q of the values in
+ * @p hist fall, e.g. 0.999 for the 99.9th percentile. The result is
+ * the upper bound of the bucket the percentile falls in.
+ *
+ * @param hist The histogram, may be @c NULL.
+ * @param q    The quantile, between 0 and 1.
+ * @return The percentile in ticks, or @c 0 if @p hist is empty.
+ */
+coap_tick_t coap_histogram_percentile(const coap_histogram_t *hist, double q);
+
+/** Returns percentile @p q of stage @p stage of @p context. */
+coap_tick_t coap_latency_percentile(struct coap_context_t *context,
+				    coap_latency_t stage, double q);
+
+/** Returns the name of latency stage @p stage. */
+const char *coap_latency_name(coap_latency_t stage);
+
+/**
+ * Creates a resource at @p uri that returns a snapshot of the metrics
+ * of the context as text, one "name value" line each, and adds it to
+ * @p context. Latencies are given as the 50th, 99th and 99.9th
+ * percentile of each stage in ticks.
+ *
+ * @return The new resource or @c NULL on error.
+ */
+struct coap_resource_t *
+coap_metrics_resource(struct coap_context_t *context,
+		      const unsigned char *uri, size_t len);
+
+/** @} */
+
+#endif /* _COAP_METRICS_H_ */
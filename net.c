@@ -9,6 +9,7 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <stddef.h>
 #include <stdio.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -25,6 +26,9 @@
 #ifdef HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
 
 #include "debug.h"
 #include "mem.h"
@@ -37,10 +41,7 @@
 #include "asynchronous.h"
 #include "subscribe.h"
 #include "utlist.h"
-
-#include <android/sensor.h>
-
-#include "globals_test.h"
+#include "trace.h"
 
 
 #ifndef WITH_CONTIKI
@@ -98,8 +99,6 @@ coap_handle_failed_notify(coap_context_t *context,  coap_registration_t *reg,
 
 coap_alive_mid_t *
 coap_mid_alive_init();
-void
-coap_clean_expired_mids(coap_alive_mid_t *list);
 coap_alive_mid_t *
 mid_is_alive(coap_context_t *context, coap_queue_t *rcvd);
 
@@ -216,6 +215,23 @@ is_wkc(coap_key_t k) {
 }
 #endif
 
+void
+coap_prng_seed_os(coap_prng_t *r, uint64_t extra) {
+  uint64_t seed = 0;
+#ifdef HAVE_GETRANDOM
+  if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed))
+    seed = 0;
+#elif !defined(WITH_CONTIKI)
+  FILE *f = fopen("/dev/urandom", "rb");
+  if (f) {
+    if (fread(&seed, sizeof(seed), 1, f) != 1)
+      seed = 0;
+    fclose(f);
+  }
+#endif
+  coap_prng_seed(r, seed ^ coap_prng_mix(extra));
+}
+
 coap_context_t *
 coap_new_context(const coap_address_t *listen_addr) {
 #ifndef WITH_CONTIKI
@@ -252,9 +268,18 @@ coap_new_context(const coap_address_t *listen_addr) {
 #endif /* WITH_CONTIKI */
 
   memset(c, 0, sizeof( coap_context_t ) );
+  c->due.key = offsetof(coap_registration_t, due);
+  c->due.pos = offsetof(coap_registration_t, due_pos);
+  c->sr.key = offsetof(coap_registration_t, sr_next);
+  c->sr.pos = offsetof(coap_registration_t, sr_pos);
+  coap_clock_update(c);
+  coap_prng_seed_os(&c->prng, (uintptr_t)listen_addr ^ c->now);
 
   /* initialize message id */
-  prng((unsigned char *)&c->message_id, sizeof(unsigned short));
+  coap_prng_fill(&c->prng, (unsigned char *)&c->message_id, 
+		 sizeof(unsigned short));
+
+  c->nstart = COAP_DEFAULT_NSTART;
 
   /* register the critical options that we know */
   coap_register_option(c, COAP_OPTION_CONTENT_TYPE);
@@ -296,6 +321,8 @@ coap_new_context(const coap_address_t *listen_addr) {
     goto onerror;
   }
 
+  coap_udp_transport_init(&c->udp, c->sockfd);
+  c->transport = &c->udp;
   return c;
 
  onerror:
@@ -321,6 +348,10 @@ coap_new_context(const coap_address_t *listen_addr) {
 #endif /* WITH_CONTIKI */
 }
 
+#ifndef WITH_CONTIKI
+static void coap_notify_clear(coap_context_t *context);
+#endif /* WITH_CONTIKI */
+
 void
 coap_free_context( coap_context_t *context ) {
 #ifndef WITH_CONTIKI
@@ -333,10 +364,15 @@ coap_free_context( coap_context_t *context ) {
   coap_delete_all(context->sendqueue);
 
 #ifndef WITH_CONTIKI
+  coap_notify_clear(context);
   HASH_ITER(hh, context->resources, res, rtmp) {
     coap_delete_resource(context, res->key);
   }
 
+  free(context->due.reg);
+  free(context->sr.reg);
+  coap_delete_peers(context);
+
   /* coap_delete_list(context->subscriptions); */
   close( context->sockfd );
   coap_free( context );
@@ -381,11 +417,8 @@ coap_option_check_critical(coap_context_t *ctx,
   return ok;
 }
 
-void
-coap_transaction_id(const coap_address_t *peer, const coap_pdu_t *pdu, 
-		    coap_tid_t *id) {
-  coap_key_t h;
-
+int
+coap_hash_address(const coap_address_t *peer, coap_key_t h) {
   memset(h, 0, sizeof(coap_key_t));
 
   /* Compare the complete address structure in case of IPv4. For IPv6,
@@ -403,18 +436,38 @@ coap_transaction_id(const coap_address_t *peer, const coap_pdu_t *pdu,
 	      sizeof(peer->addr.sin6.sin6_addr), h);
     break;
   default:
-    return;
+    return 0;
   }
 #else /* WITH_CONTIKI */
     coap_hash((const unsigned char *)&peer->port, sizeof(peer->port), h);
     coap_hash((const unsigned char *)&peer->addr, sizeof(peer->addr), h);  
 #endif /* WITH_CONTIKI */
 
+  return 1;
+}
+
+/* Completes the transaction id of pdu from the address hash key of
+ * its peer. */
+static inline void
+coap_transaction_id_from_key(const coap_key_t key, const coap_pdu_t *pdu,
+			     coap_tid_t *id) {
+  coap_key_t h;
+
+  memcpy(h, key, sizeof(coap_key_t));
   coap_hash((const unsigned char *)&pdu->hdr->id, sizeof(unsigned short), h);
 
   *id = ((h[0] << 8) | h[1]) ^ ((h[2] << 8) | h[3]);
 }
 
+void
+coap_transaction_id(const coap_address_t *peer, const coap_pdu_t *pdu, 
+		    coap_tid_t *id) {
+  coap_key_t h;
+
+  if (coap_hash_address(peer, h))
+    coap_transaction_id_from_key(h, pdu, id);
+}
+
 coap_tid_t
 coap_send_ack(coap_context_t *context, 
 	      const coap_address_t *dst,
@@ -434,6 +487,15 @@ coap_send_ack(coap_context_t *context,
 }
 
 #ifndef WITH_CONTIKI
+/* Returns the id of the peer at dst for probes, which must not
+ * create one. */
+static inline coap_peer_id_t
+coap_peer_id_at(coap_context_t *context, const coap_address_t *dst) {
+  coap_peer_t *peer = coap_peer_find(context, dst);
+
+  return peer ? peer->id : COAP_PEER_NONE;
+}
+
 /* releases space allocated by PDU if free_pdu is set */
 coap_tid_t
 coap_send_impl(coap_context_t *context, 
@@ -465,45 +527,37 @@ coap_send_impl(coap_context_t *context,
 
   ssize_t bytes_written;
   coap_tid_t id = COAP_INVALID_TID;
+  coap_tick_t start, end;
 
   if ( !context || !dst || !pdu )
     return id;
 
-  bytes_written = sendto( context->sockfd, pdu->hdr, pdu->length, 0,
-			  &dst->addr.sa, dst->size);
+  coap_ticks(&start);
+  bytes_written = context->transport->send(context->transport, dst,
+					   (unsigned char *)pdu->hdr,
+					   pdu->length);
+  coap_ticks(&end);
+  coap_latency_add(context, COAP_LATENCY_SEND, end - start);
 
   if (bytes_written >= 0) {
     coap_transaction_id(dst, pdu, &id);
 
 
-    LOGI("--- Sent packet -----------");
-    printpdu(pdu);
-    LOGI("---------------------------");
+    coap_trace(COAP_TRACE_SEND, pdu->hdr->type << 8 | pdu->hdr->code,
+	       ntohs(pdu->hdr->id), bytes_written);
+    if (coap_trace_on(COAP_TRACE_VERBOSE))
+      printpdu(pdu);
 
+    coap_metric_add(context, COAP_METRIC_OUT_CON + pdu->hdr->type, 1);
+    coap_metric_add(context, COAP_METRIC_OUT_CON_BYTES + pdu->hdr->type,
+		    bytes_written);
 
-	UDP_OUT_counter++;
-	UDP_OUT_octects += bytes_written;
-
-	if (pdu->hdr->type == COAP_MESSAGE_NON) {
-		OUT_NON_counter++;
-		OUT_NON_octects += bytes_written;
-	}
-	else if (pdu->hdr->type == COAP_MESSAGE_CON) {
-		OUT_CON_counter++;
-		OUT_CON_octects += bytes_written;
-	}
-	else if (pdu->hdr->type == COAP_MESSAGE_ACK) {
-		OUT_ACK_counter++;
-		OUT_ACK_octects += bytes_written;
-	}
-	else if (pdu->hdr->type == COAP_MESSAGE_RST) {
-		OUT_RST_counter++;
-		OUT_RST_octects += bytes_written;
-	}
+    coap_probe(send, ntohs(pdu->hdr->id), coap_peer_id_at(context, dst),
+	       pdu->hdr->type, bytes_written);
 
 
   } else {
-    coap_log(LOG_CRIT, "coap_send: sendto");
+    coap_log(LOG_CRIT, "coap_send: %s send", context->transport->name);
   }
 
   return id;
@@ -580,13 +634,366 @@ _order_timestamp( coap_queue_t *lhs, coap_queue_t *rhs ) {
   return lhs && rhs && ( lhs->t < rhs->t ) ? -1 : 1;
 }
 
+coap_queue_t *
+coap_new_timer(coap_context_t *context, coap_tick_t t,
+	       coap_timer_handler_t handler, void *data) {
+  coap_queue_t *node;
+
+  node = coap_new_node();
+  if (!node)
+    return NULL;
+
+  node->t = t;
+  node->id = COAP_INVALID_TID;	/* never matches a transaction */
+  node->handler = handler;
+  node->data = data;
+
+  coap_insert_node(&context->sendqueue, node, _order_timestamp);
+  return node;
+}
+
+void
+coap_reschedule_timer(coap_context_t *context, coap_queue_t *timer, 
+		      coap_tick_t t) {
+  coap_queue_t **p = &context->sendqueue;
+
+  while (*p && *p != timer)
+    p = &(*p)->next;
+
+  if (*p) {
+    *p = timer->next;
+    timer->next = NULL;
+  }
+
+  timer->t = t;
+  coap_insert_node(&context->sendqueue, timer, _order_timestamp);
+}
+
+unsigned short
+coap_new_peer_message_id(coap_context_t *context, const coap_address_t *dst) {
+  coap_peer_t *peer = coap_peer_get(context, dst);
+
+  if (!peer)
+    return coap_new_message_id(context);
+
+#ifndef WITH_CONTIKI
+  return htons(coap_peer_message_id(peer, context->now));
+#else /* WITH_CONTIKI */
+  return uip_htons(coap_peer_message_id(peer, context->now));
+#endif
+}
+
+/* Drops a reference to reg. Like in coap_retransmit(), a registration
+ * whose resource has been deleted is left alone rather than removed
+ * from a list that no longer exists. */
+static inline void
+coap_registration_drop(coap_context_t *context, coap_registration_t *reg) {
+  coap_resource_t *res = coap_get_resource_from_key(context, reg->reskey);
+
+  if (res != NULL)
+    coap_registration_release(res, reg);
+}
+
+#define COAP_HEAP_KEY(Heap, Reg)				\
+  (*(coap_tick_t *)((unsigned char *)(Reg) + (Heap)->key))
+#define COAP_HEAP_POS(Heap, Reg)				\
+  (*(unsigned int *)((unsigned char *)(Reg) + (Heap)->pos))
+
+static inline void
+coap_heap_place(coap_reg_heap_t *heap, unsigned int i, 
+		coap_registration_t *reg) {
+  heap->reg[i] = reg;
+  COAP_HEAP_POS(heap, reg) = i + 1;
+}
+
+/* Restores the order of heap for the entry at i after its key has
+ * changed. */
+static void
+coap_heap_sift(coap_reg_heap_t *heap, unsigned int i) {
+  coap_registration_t *reg = heap->reg[i];
+  coap_tick_t key = COAP_HEAP_KEY(heap, reg);
+  unsigned int child;
+
+  while (i && COAP_HEAP_KEY(heap, heap->reg[(i - 1) / 2]) > key) {
+    coap_heap_place(heap, i, heap->reg[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+
+  while ((child = 2 * i + 1) < heap->count) {
+    if (child + 1 < heap->count &&
+	COAP_HEAP_KEY(heap, heap->reg[child + 1]) 
+	< COAP_HEAP_KEY(heap, heap->reg[child]))
+      child++;
+    if (key <= COAP_HEAP_KEY(heap, heap->reg[child]))
+      break;
+    coap_heap_place(heap, i, heap->reg[child]);
+    i = child;
+  }
+
+  coap_heap_place(heap, i, reg);
+}
+
+/* Adds reg, which must not be in heap yet, and checks it out. Returns
+ * 0 if there is no memory. */
+static int
+coap_heap_insert(coap_reg_heap_t *heap, coap_registration_t *reg) {
+  coap_registration_t **regs;
+  unsigned int size;
+
+  if (heap->count == heap->size) {
+    size = heap->size ? 2 * heap->size : 16;
+    regs = (coap_registration_t **)
+      realloc(heap->reg, size * sizeof(coap_registration_t *));
+    if (!regs) {
+#ifndef NDEBUG
+      coap_log(LOG_WARN, "coap_heap_insert: malloc\n");
+#endif
+      return 0;
+    }
+    heap->reg = regs;
+    heap->size = size;
+  }
+
+  coap_registration_checkout(reg); /* held by the heap */
+  heap->reg[heap->count] = reg;
+  COAP_HEAP_POS(heap, reg) = ++heap->count;
+  coap_heap_sift(heap, heap->count - 1);
+  return 1;
+}
+
+/* Removes the top of heap and drops its reference. */
+static void
+coap_heap_pop(coap_context_t *context, coap_reg_heap_t *heap) {
+  coap_registration_t *reg = heap->reg[0];
+
+  COAP_HEAP_POS(heap, reg) = 0;
+  if (--heap->count) {
+    coap_heap_place(heap, 0, heap->reg[heap->count]);
+    coap_heap_sift(heap, 0);
+  }
+
+  coap_registration_drop(context, reg);
+}
+
+/* Returns the peer of node, binding node to it on first use. */
+static inline coap_peer_t *
+coap_node_peer(coap_context_t *context, coap_queue_t *node) {
+  coap_peer_t *peer = coap_peer_by_id(&context->peers, node->peer);
+
+  if (!peer) {
+    peer = coap_peer_get(context, &node->remote);
+    if (peer)
+      node->peer = peer->id;
+  }
+  return peer;
+}
+
+/* Binds reg to peer and adds it to the registrations of peer. */
+static void
+coap_registration_bind(coap_registration_t *reg, coap_peer_t *peer) {
+  if (reg->peer == peer->id && reg->peer_prev)
+    return;
+
+  coap_registration_unbind(reg);
+  reg->peer = peer->id;
+  reg->peer_next = peer->regs;
+  if (peer->regs)
+    peer->regs->peer_prev = &reg->peer_next;
+  reg->peer_prev = &peer->regs;
+  peer->regs = reg;
+}
+
+/* Ends all registrations of peer at once, calling the on_unregister
+ * handler of each resource involved. */
+static void
+coap_peer_unregister(coap_context_t *context, coap_peer_t *peer) {
+  coap_registration_t *reg, *next;
+  coap_resource_t *res;
+
+  for (reg = peer->regs; reg; reg = next) {
+    next = reg->peer_next;
+    if (reg->invalid || reg->fail_cnt > COAP_OBS_MAX_FAIL)
+      continue;
+
+    /* as if each had failed, so that late ACKs and failures of
+     * other notifications leave it alone */
+    reg->fail_cnt = COAP_OBS_MAX_FAIL + 1;
+    res = coap_get_resource_from_key(context, reg->reskey);
+    if (res && res->on_unregister)
+      res->on_unregister(context, reg);
+  }
+}
+
+/* Counts a confirmable message to peer that was never acknowledged
+ * and ends all registrations of peer once it looks dead. */
+static void
+coap_peer_failed(coap_context_t *context, coap_peer_t *peer) {
+  if (peer && ++peer->fail_cnt > COAP_OBS_MAX_FAIL) {
+    debug("peer %u does not respond, unregistering\n", peer->id);
+    coap_peer_unregister(context, peer);
+  }
+}
+
+/* Sets the time of the first transmission of node and its initial
+ * timeout, which is randomized to [1, 1.5] times the RTO of the peer. */
+static void
+coap_initial_timeout(coap_context_t *context, coap_queue_t *node) {
+  coap_peer_t *peer;
+  coap_tick_t rto;
+
+  node->sent = context->now;
+
+  peer = coap_node_peer(context, node);
+  rto = peer ? coap_peer_rto(peer, node->sent)
+    : COAP_DEFAULT_RESPONSE_TIMEOUT * COAP_TICKS_PER_SECOND;
+
+  node->timeout = rto + coap_prng_below(&context->prng, rto / 2 + 1);
+  node->backoff = coap_peer_backoff(rto);
+  node->t = node->sent + node->timeout;
+  debug("timeout assigned to %llu, clock %llu\n", 
+	(unsigned long long)node->timeout, (unsigned long long)node->sent);
+}
+
+/* Returns the time when the data in notification pdu for reg gets
+ * stale, which is after reg->freshness, the Max-Age of pdu or, if
+ * neither is given, after COAP_OBS_STALE_GAPS notification periods,
+ * at most COAP_OBS_MAX_SILENCE. Returns 0 for no deadline. */
+static coap_tick_t
+coap_notify_deadline(coap_registration_t *reg, coap_pdu_t *pdu, 
+		     coap_tick_t now) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *opt;
+  coap_tick_t fresh;
+
+  if (reg->freshness) {
+    fresh = reg->freshness;
+  } else if ((opt = coap_check_option(pdu, COAP_OPTION_MAXAGE, &opt_iter))) {
+    fresh = coap_decode_var_bytes(COAP_OPT_VALUE(opt), COAP_OPT_LENGTH(opt))
+      * COAP_TICKS_PER_SECOND;
+    /* Max-Age 0 tells caches, not retransmissions, what to do */
+    if (!fresh)
+      return 0;
+  } else {
+    /* stale once newer samples should have replaced it */
+    fresh = COAP_OBS_MAX_SILENCE * COAP_TICKS_PER_SECOND;
+    if (reg->gap && COAP_OBS_STALE_GAPS * reg->gap < fresh)
+      fresh = COAP_OBS_STALE_GAPS * reg->gap;
+  }
+
+  return now + fresh;
+}
+
+/* Called whenever a confirmable notification for reg leaves the
+ * sendqueue. */
+static inline void
+coap_notify_done(coap_registration_t *reg) {
+  if (reg->inflight)
+    reg->inflight--;
+}
+
+/* Sends the confirmable message in node and puts node into the
+ * sendqueue. If NSTART transactions with the peer are outstanding,
+ * node is queued at the peer instead, to be sent by coap_peer_drain().
+ * Returns the transaction id or COAP_INVALID_TID on error, in which
+ * case the caller keeps node. */
+static coap_tid_t
+coap_send_node(coap_context_t *context, coap_queue_t *node) {
+  coap_peer_t *peer = coap_node_peer(context, node);
+
+  if (peer && peer->outstanding >= context->nstart) {
+    coap_transaction_id_from_key(peer->key, node->pdu, &node->id);
+    LL_APPEND(peer->pending, node);
+    return node->id;
+  }
+
+  node->id = coap_send_impl(context, &node->remote, node->pdu);
+  if (COAP_INVALID_TID == node->id)
+    return COAP_INVALID_TID;
+
+  coap_initial_timeout(context, node);
+  assert(&context->sendqueue);
+  coap_insert_node(&context->sendqueue, node, _order_timestamp);
+  if (peer)
+    peer->outstanding++;
+
+  return node->id;
+}
+
+/* Accounts the notification in node, which got stale before it was
+ * acknowledged, and drops the reference of node to its registration.
+ * The freshest sample held back takes its place, and the next
+ * notification checks with a CON that the observer is alive. */
+static void
+coap_notify_stale(coap_context_t *context, coap_queue_t *node) {
+  coap_registration_t *reg = node->reg;
+  str token = { 0, NULL };
+
+  coap_notify_done(reg);
+  reg->expired++;
+  coap_metric_add(context, COAP_METRIC_EXPIRED, 1);
+  reg->non_cnt = reg->non_run;
+
+  if (++reg->expired_run > COAP_OBS_MAX_FAIL) {
+    /* nothing has been acknowledged for too long */
+    token.length = reg->token_length;
+    token.s = reg->token;
+    if (reg->fail_cnt < COAP_OBS_MAX_FAIL)
+      reg->fail_cnt = COAP_OBS_MAX_FAIL;
+    coap_peer_failed(context, coap_node_peer(context, node));
+    coap_handle_failed_notify(context, reg, &node->remote, &token);
+  } else {
+    coap_check_registration(context, reg);
+    coap_registration_drop(context, reg);
+  }
+}
+
+/* Called when a confirmable message to node->remote has left the
+ * sendqueue. Sends messages queued at the peer as long as NSTART
+ * allows. */
+static void
+coap_peer_drain(coap_context_t *context, coap_queue_t *done) {
+  coap_peer_t *peer = coap_node_peer(context, done);
+  coap_queue_t *node;
+  coap_tick_t now;
+
+  if (!peer)
+    return;
+
+  if (peer->outstanding)
+    peer->outstanding--;
+
+  now = context->now;
+  while (peer->pending && peer->outstanding < context->nstart) {
+    node = peer->pending;
+    LL_DELETE(peer->pending, node);
+    node->next = NULL;
+
+    if (node->reg) {
+      /* notifications that went stale while waiting are not sent */
+      int stale = node->deadline && now >= node->deadline;
+
+      if (!stale && !node->reg->invalid &&
+	  COAP_INVALID_TID != coap_send_node(context, node))
+	continue;
+
+      if (stale) {
+	coap_notify_stale(context, node);
+      } else {
+	coap_notify_done(node->reg);
+	coap_registration_drop(context, node->reg);
+      }
+    } else if (COAP_INVALID_TID != coap_send_node(context, node)) {
+      continue;
+    }
+    coap_delete_node(node);
+  }
+}
+
 coap_tid_t
 coap_send_confirmed(coap_context_t *context, 
 		    const coap_address_t *dst,
 		    coap_pdu_t *pdu) {
   coap_queue_t *node;
-  coap_tick_t now;
-  int r;
 
   node = coap_new_node();
   if (!node) {
@@ -594,35 +1001,6 @@ coap_send_confirmed(coap_context_t *context,
     return COAP_INVALID_TID;
   }
 
-  /* assigns a new transaction ID and sends, returns the transaction id */
-  node->id = coap_send_impl(context, dst, pdu);
-  if (COAP_INVALID_TID == node->id) {
-    debug("coap_send_confirmed: error sending pdu\n");
-    coap_free_node(node);
-    return COAP_INVALID_TID;
-  }
-
-  LOGI("Sent CON mess id%d, new outstanding transaction id%d", pdu->hdr->id, node->id);
-  
-  prng((unsigned char *)&r,sizeof(r));
-  coap_ticks(&now);
-  node->t = now;
-
-  /* add randomized RESPONSE_TIMEOUT to determine retransmission timeout */
-  /*node->timeout = COAP_DEFAULT_RESPONSE_TIMEOUT * COAP_TICKS_PER_SECOND +
-    (COAP_DEFAULT_RESPONSE_TIMEOUT >> 1) *
-    ((COAP_TICKS_PER_SECOND * (r & 0xFF)) >> 8);*/
-  /*
-  int a = 0.150 * 1024;
-  float y = rand()/(float)RAND_MAX;
-  int b = a + (a/3)*y;
-   */
-  int a = 0.150 * 1024;
-  float y = rand()/(float)RAND_MAX;
-  node->timeout = a + (a/3)*y;
-  LOGW("Timeout assigned to:%d coapclk:%d", node->timeout, now);
-  node->t += node->timeout;
-
   memcpy(&node->remote, dst, sizeof(coap_address_t));
   node->pdu = pdu;
 
@@ -631,8 +1009,14 @@ coap_send_confirmed(coap_context_t *context,
    * but let's be safe! */
   node->reg = NULL;
 
-  assert(&context->sendqueue);
-  coap_insert_node(&context->sendqueue, node, _order_timestamp);
+  /* assigns a new transaction ID and sends, returns the transaction id */
+  if (COAP_INVALID_TID == coap_send_node(context, node)) {
+    debug("coap_send_confirmed: error sending pdu\n");
+    coap_free_node(node);
+    return COAP_INVALID_TID;
+  }
+
+  coap_trace(COAP_TRACE_CON_QUEUED, ntohs(pdu->hdr->id), node->id, 0);
 
 #ifdef WITH_CONTIKI
   {			    /* (re-)initialize retransmission timer */
@@ -668,8 +1052,33 @@ coap_notify_confirmed(coap_context_t *context,
 		 */
 
   coap_queue_t *node;
-  coap_tick_t now;
-  int r;
+  coap_peer_t *peer;
+
+  /* whatever id the streaming manager chose, it must come from the
+   * message id space of the peer */
+  pdu->hdr->id = coap_new_peer_message_id(context, dst);
+
+  /* A notification still waiting for the peer is stale now, so
+   * the new one takes its place. */
+  peer = reg ? coap_peer_by_id(&context->peers, reg->peer) : NULL;
+  if (reg && !peer) {
+    peer = coap_peer_get(context, dst);
+    if (peer)
+      coap_registration_bind(reg, peer);
+  }
+  if (peer) {
+    LL_FOREACH(peer->pending, node) {
+      if (node->reg == reg) {
+	coap_delete_pdu(node->pdu);
+	node->pdu = pdu;
+	node->deadline = coap_notify_deadline(reg, pdu, context->now);
+	coap_transaction_id_from_key(peer->key, pdu, &node->id);
+	/* the caller checks out reg again for the node */
+	coap_registration_drop(context, reg);
+	return node->id;
+      }
+    }
+  }
 
   node=coap_new_node();
   if (!node) {
@@ -677,76 +1086,921 @@ coap_notify_confirmed(coap_context_t *context,
     return COAP_INVALID_TID;
   }
 
+  memcpy(&node->remote, dst, sizeof(coap_address_t));
+  node->pdu = pdu;
+  if (reg)
+    node->deadline = coap_notify_deadline(reg, pdu, context->now);
+
+  /* As a conceptual separation, we let the checkout be done when passing
+   * reg as a parameter by the caller:
+   * coap_notify_confirmed( , , , coap_registration_checkout(reg) ) */
+  node->reg = reg;
+
   /* assigns a new transaction ID and sends, returns the transaction id */
-  node->id = coap_send_impl(context, dst, pdu);
-  if (COAP_INVALID_TID == node->id) {
+  if (COAP_INVALID_TID == coap_send_node(context, node)) {
 	LOGI("Invalid TID, error sending PDU");
     debug("coap_notify: error sending pdu\n");
     coap_free_node(node);
     return COAP_INVALID_TID;
   }
 
-  prng((unsigned char *)&r,sizeof(r));
-  coap_ticks(&now);
-  node->t = now;
+  if (reg)
+    reg->inflight++;
 
-  /* add randomized RESPONSE_TIMEOUT to determine retransmission timeout */
-  /*node->timeout = COAP_DEFAULT_RESPONSE_TIMEOUT * COAP_TICKS_PER_SECOND +
-    (COAP_DEFAULT_RESPONSE_TIMEOUT >> 1) *
-    ((COAP_TICKS_PER_SECOND * (r & 0xFF)) >> 8);*/
-  /*
-  int a = 0.150 * 1024;
-  float y = rand()/(float)RAND_MAX;
-  int b = a + (a/3)*y;
-   */
-  int a = 0.150 * 1024;
-  float y = rand()/(float)RAND_MAX;
-  node->timeout = a + (a/3)*y;
-  LOGW("Timeout assigned to:%d coapclk:%d", node->timeout, now);
-  node->t += node->timeout;
+  coap_trace(COAP_TRACE_CON_QUEUED, ntohs(pdu->hdr->id), node->id, 1);
 
-  memcpy(&node->remote, dst, sizeof(coap_address_t));
-  node->pdu = pdu;
+  /* returns the transaction id */
+  return node->id;
+}
 
-  /* As a conceptual separation, we let the checkout be done when passing
-   * reg as a parameter by the caller:
-   * coap_notify_confirmed( , , , coap_registration_checkout(reg) ) */
-  node->reg = reg;
+/* Estimated size of a sender report for reg on the wire, including
+ * UDP and IPv4 headers. */
+#define COAP_SR_SIZE(reg)						\
+  (28 + sizeof(coap_hdr_t) + 3 + 1 + (reg)->token_length		\
+   + sizeof(ze_payload_header_t) + 20)
+
+#define COAP_SR_TICKS(Seconds) ((Seconds) * COAP_TICKS_PER_SECOND)
+
+/* Returns the time until the next report for reg, given that the last
+ * one was sent at reg->sr_last. As in RFC 3550, the deterministic
+ * interval makes reports take 1/COAP_SR_BW_DIVISOR of the bandwidth of
+ * the stream, and is randomized to [0.5, 1.5] times its value. */
+static coap_tick_t
+coap_sr_interval(coap_context_t *context, coap_registration_t *reg, 
+		 coap_tick_t now) {
+  unsigned long long octets, t;
+
+  octets = (unsigned int)(reg->octcount - reg->last_sr_octcount);
+  if (octets)
+    t = COAP_SR_BW_DIVISOR * COAP_SR_SIZE(reg) 
+      * (unsigned long long)(now - reg->sr_last) / octets;
+  else
+    t = COAP_SR_TICKS(COAP_SR_MAX_INTERVAL);
+
+  if (t < COAP_SR_TICKS(COAP_SR_MIN_INTERVAL))
+    t = COAP_SR_TICKS(COAP_SR_MIN_INTERVAL);
+  else if (t > COAP_SR_TICKS(COAP_SR_MAX_INTERVAL))
+    t = COAP_SR_TICKS(COAP_SR_MAX_INTERVAL);
+
+  return t / 2 + coap_prng_below(&context->prng, t + 1);
+}
 
-  /* Insert the node into the sendqueue. */
-  assert(&context->sendqueue);
-  coap_insert_node(&context->sendqueue, node, _order_timestamp);
+static inline unsigned char *
+coap_sr_put(unsigned char *p, unsigned long long value, int len) {
+  while (len--)
+    *p++ = value >> (8 * len);
+  return p;
+}
+
+/* Sends a sender report on reg if the streaming manager has provided
+ * the timestamp pair, and schedules the next one. */
+static void
+coap_sr_send(coap_context_t *context, coap_registration_t *reg, 
+	     coap_tick_t now) {
+  unsigned char buf[sizeof(ze_payload_header_t) + 20];
+  unsigned char obs[2];
+  ze_payload_header_t header;
+  unsigned char *p;
+  coap_pdu_t *pdu;
+
+  if (reg->srready) {
+    pdu = coap_pdu_init(COAP_MESSAGE_NON, COAP_RESPONSE_CODE(205),
+			coap_new_peer_message_id(context, &reg->subscriber), 
+			COAP_MAX_PDU_SIZE);
+    if (pdu) {
+      /* reports do not take a sequence number of their own */
+      coap_sr_put(obs, (unsigned short)reg->notcnt, 2);
+      coap_add_option(pdu, COAP_OPTION_SUBSCRIPTION, 2, obs);
+      if (reg->token_length)
+	coap_add_option(pdu, COAP_OPTION_TOKEN, reg->token_length, reg->token);
+
+      memset(&header, 0, sizeof(header));
+      header.packet_type = SENDREPORT;
+      header.sensor_type = reg->sr_sensor_type;
+      memcpy(buf, &header, sizeof(header));
+
+      p = coap_sr_put(buf + sizeof(header), reg->ntptwin, 8);
+      p = coap_sr_put(p, (unsigned int)reg->rtptwin, 4);
+      p = coap_sr_put(p, (unsigned int)reg->datapackcount, 4);
+      p = coap_sr_put(p, (unsigned int)reg->octcount, 4);
+      coap_add_data(pdu, p - buf, buf);
+
+      if (coap_send(context, &reg->subscriber, pdu) != COAP_INVALID_TID) {
+	reg->sr_next = now + coap_sr_interval(context, reg, now);
+	reg->sr_last = now;
+	reg->last_sr_octcount = reg->octcount;
+	reg->last_sr_packcount = reg->datapackcount;
+	coap_delete_pdu(pdu);
+	return;
+      }
+      coap_delete_pdu(pdu);
+    }
+  }
 
-  LOGI("Sent CON notif, mess id:%u, new outstanding transaction id:%d", pdu->hdr->id, node->id);
+  /* nothing sent, try again later */
+  reg->sr_next = now + coap_sr_interval(context, reg, now);
+}
 
-  /* returns the transaction id */
-  return node->id;
+/* Sends the report on reg and moves it to its next one in the heap of
+ * context. */
+static inline void
+coap_sr_resend(coap_context_t *context, coap_registration_t *reg,
+	       coap_tick_t now) {
+  coap_sr_send(context, reg, now);
+  coap_heap_sift(&context->sr, reg->sr_pos - 1);
+}
+
+/* Expiry of context->sr_timer. Sends all reports that are due, together
+ * with the reports for other streams to the same peer that would be
+ * due within half the minimum interval, and re-arms the timer for the
+ * top of context->sr. */
+static void
+coap_sr_timeout(coap_context_t *context, coap_queue_t *timer) {
+  coap_registration_t *reg, *other;
+  coap_peer_t *peer;
+  coap_tick_t now, horizon;
+
+  now = context->now;
+  horizon = now + COAP_SR_TICKS(COAP_SR_MIN_INTERVAL) / 2;
+
+  while (context->sr.count && context->sr.reg[0]->sr_next <= now) {
+    reg = context->sr.reg[0];
+    if (reg->invalid) {
+      coap_heap_pop(context, &context->sr);
+      continue;
+    }
+
+    /* the other streams to the same peer are in its list */
+    peer = reg->peer_prev ? coap_peer_by_id(&context->peers, reg->peer)
+      : NULL;
+    if (peer) {
+      for (other = peer->regs; other; other = other->peer_next) {
+	if (other != reg && !other->invalid && other->sr_pos 
+	    && other->sr_next <= horizon)
+	  coap_sr_resend(context, other, now);
+      }
+    }
+    coap_sr_resend(context, reg, now);
+  }
+
+  if (context->sr.count) {
+    timer->t = context->sr.reg[0]->sr_next;
+    coap_insert_node(&context->sendqueue, timer, _order_timestamp);
+  } else {
+    context->sr_timer = NULL;
+    coap_delete_node(timer);
+  }
+}
+
+/* Accounts a data notification with len bytes of payload sent on reg
+ * at time now, and schedules the first report of the stream. */
+static void
+coap_sr_update(coap_context_t *context, coap_registration_t *reg,
+	       int sensor_type, size_t len, coap_tick_t now) {
+  reg->sr_sensor_type = sensor_type;
+  reg->datapackcount++;
+  reg->octcount += len;
+
+  if (reg->sr_next)
+    return;
+
+  /* the first report comes after half the minimum interval */
+  reg->sr_last = now;
+  reg->sr_next = now + COAP_SR_TICKS(COAP_SR_MIN_INTERVAL) / 4 
+    + coap_prng_below(&context->prng, COAP_SR_TICKS(COAP_SR_MIN_INTERVAL) / 2 + 1);
+  if (!coap_heap_insert(&context->sr, reg)) {
+    reg->sr_next = 0;		/* try again with the next notification */
+    return;
+  }
+
+  if (!context->sr_timer)
+    context->sr_timer = coap_new_timer(context, context->sr.reg[0]->sr_next,
+				       coap_sr_timeout, NULL);
+  else if (context->sr.reg[0]->sr_next < context->sr_timer->t)
+    coap_reschedule_timer(context, context->sr_timer, 
+			  context->sr.reg[0]->sr_next);
+}
+
+#define COAP_LEASE_SLOT(Sec) ((Sec) & (COAP_LEASE_SLOTS - 1))
+
+/* Expiry of context->lease_timer. Unregisters the observers whose
+ * lease has ended in the seconds since the last run, and stops when
+ * the wheel is empty. */
+static void
+coap_lease_timeout(coap_context_t *context, coap_queue_t *timer) {
+  coap_registration_t *reg, *next;
+  coap_resource_t *res;
+  coap_tick_t now, sec, end;
+  unsigned int i;
+
+  now = context->now;
+  end = now / COAP_TICKS_PER_SECOND;
+  sec = context->lease_cursor;
+  if (end - sec >= COAP_LEASE_SLOTS)
+    sec = end - COAP_LEASE_SLOTS + 1;
+
+  for (; sec <= end; sec++) {
+    for (reg = context->lease_wheel[COAP_LEASE_SLOT(sec)]; reg; reg = next) {
+      next = reg->lease_next;
+      if (reg->lease > now)	/* a later turn of the wheel */
+	continue;
+
+      coap_registration_unlease(reg);
+      res = coap_get_resource_from_key(context, reg->reskey);
+      if (res && res->on_unregister && !reg->invalid &&
+	  reg->fail_cnt <= COAP_OBS_MAX_FAIL) {
+	debug("lease of registration expired\n");
+	/* as if it had failed, see coap_peer_unregister() */
+	reg->fail_cnt = COAP_OBS_MAX_FAIL + 1;
+	res->on_unregister(context, reg);
+      }
+    }
+  }
+  context->lease_cursor = end + 1;
+
+  for (i = 0; i < COAP_LEASE_SLOTS && !context->lease_wheel[i]; i++)
+    ;
+  if (i < COAP_LEASE_SLOTS) {
+    timer->t = context->lease_cursor * COAP_TICKS_PER_SECOND;
+    coap_insert_node(&context->sendqueue, timer, _order_timestamp);
+  } else {
+    context->lease_timer = NULL;
+    coap_delete_node(timer);
+  }
+}
+
+/* Starts or restarts the lease of reg, called whenever the observer
+ * registers. */
+static void
+coap_lease_refresh(coap_context_t *context, coap_registration_t *reg) {
+  coap_registration_t **slot;
+  coap_tick_t now, sec;
+
+  coap_registration_unlease(reg);
+  if (!reg->lease_time && !COAP_OBS_LEASE)
+    return;
+
+  now = context->now;
+  reg->lease = now + (reg->lease_time ? reg->lease_time
+		      : COAP_OBS_LEASE * COAP_TICKS_PER_SECOND);
+
+  if (!context->lease_timer) {
+    context->lease_cursor = now / COAP_TICKS_PER_SECOND;
+    context->lease_timer = coap_new_timer(context, 
+	  (context->lease_cursor + 1) * COAP_TICKS_PER_SECOND,
+	  coap_lease_timeout, NULL);
+    if (!context->lease_timer)
+      return;
+  }
+
+  sec = reg->lease / COAP_TICKS_PER_SECOND;
+  if (sec < context->lease_cursor)
+    sec = context->lease_cursor;
+
+  slot = &context->lease_wheel[COAP_LEASE_SLOT(sec)];
+  reg->lease_next = *slot;
+  if (*slot)
+    (*slot)->lease_prev = &reg->lease_next;
+  reg->lease_prev = slot;
+  *slot = reg;
+}
+
+/* Returns 1 if notification pdu for reg must be held back at time now. */
+static inline int
+coap_notify_blocked(coap_registration_t *reg, coap_pdu_t *pdu, coap_tick_t now) {
+  if (pdu->hdr->type == COAP_MESSAGE_CON && reg->inflight >= reg->max_inflight)
+    return 1;
+  return reg->pmin && reg->last_notify && now - reg->last_notify < reg->pmin;
+}
+
+/* Returns when reg must be checked next by coap_check_due(), or 0 if
+ * there is nothing to do until its state changes. */
+static coap_tick_t
+coap_registration_due(coap_context_t *context, coap_registration_t *reg) {
+  if (reg->invalid)
+    return 0;
+
+  if (reg->pending) {
+    /* an ACK releases it */
+    if (reg->pending->hdr->type == COAP_MESSAGE_CON &&
+	reg->inflight >= reg->max_inflight)
+      return 0;
+    if (reg->pmin && reg->last_notify &&
+	context->now - reg->last_notify < reg->pmin)
+      return reg->last_notify + reg->pmin;
+    /* the scheduler takes care of it once pmin has elapsed */
+    return context->notify_rate ? 0 : context->now;
+  }
+
+  if (reg->pmax && reg->last)
+    return reg->last_notify + reg->pmax;
+  return 0;
+}
+
+/* Moves reg to the time it is due next in the due heap of context,
+ * adding it if needed. A registration with nothing due goes to the
+ * top with due 0, coap_check_due() removes it there. This never
+ * releases reg, so callers may go on using it. */
+static void
+coap_registration_reschedule(coap_context_t *context, 
+			     coap_registration_t *reg) {
+  coap_tick_t t = coap_registration_due(context, reg);
+
+  if (!reg->due_pos && !t)
+    return;
+
+  reg->due = t;
+  if (reg->due_pos)
+    coap_heap_sift(&context->due, reg->due_pos - 1);
+  else
+    coap_heap_insert(&context->due, reg);
+}
+
+/* Returns the earliest time a registration below entry i of the due
+ * heap is due, or 0 if there is none. Entries with nothing due sort
+ * first and are left for coap_check_due() to remove, so only they are
+ * descended into. */
+static coap_tick_t
+coap_due_earliest(coap_context_t *context, unsigned int i) {
+  coap_tick_t left, right;
+
+  if (i >= context->due.count)
+    return 0;
+  if (context->due.reg[i]->due)
+    return context->due.reg[i]->due;
+
+  left = coap_due_earliest(context, 2 * i + 1);
+  right = coap_due_earliest(context, 2 * i + 2);
+  return !left || (right && right < left) ? right : left;
+}
+
+/* Queues reg, whose pending notification is no longer held back, for
+ * the notification scheduler. The queue holds a reference to reg. */
+static void
+coap_notify_enqueue(coap_context_t *context, coap_registration_t *reg) {
+  coap_resource_t *r;
+
+  if (reg->notify_queued)
+    return;
+
+  r = coap_get_resource_from_key(context, reg->reskey);
+  if (!r)
+    return;
+
+  coap_registration_checkout(reg);
+  reg->notify_queued = 1;
+  reg->notify_next = NULL;
+  if (r->notify_queue)
+    r->notify_queue_tail->notify_next = reg;
+  else
+    r->notify_queue = reg;
+  r->notify_queue_tail = reg;
+
+  if (!r->notify_active) {
+    r->notify_active = 1;
+    r->notify_next = NULL;
+    if (context->notify_head)
+      context->notify_tail->notify_next = r;
+    else
+      context->notify_head = r;
+    context->notify_tail = r;
+  }
+}
+
+/* Returns the longest NON run that keeps the time between two
+ * confirmable notifications of reg below COAP_OBS_MAX_SILENCE. */
+static inline unsigned int
+coap_non_ceiling(coap_registration_t *reg) {
+  unsigned int n = COAP_OBS_MAX_NON_RUN;
+
+  if (reg->gap && COAP_OBS_MAX_SILENCE * COAP_TICKS_PER_SECOND / reg->gap < n)
+    n = COAP_OBS_MAX_SILENCE * COAP_TICKS_PER_SECOND / reg->gap;
+  return n < COAP_OBS_MIN_NON_RUN ? COAP_OBS_MIN_NON_RUN : n;
+}
+
+/* Adapts the NON run of reg to the ACK for node received at now. Only
+ * ACKs for transmissions that were not repeated yield an RTT sample,
+ * as the ACK of a retransmission is ambiguous. */
+static void
+coap_notify_acked(coap_registration_t *reg, coap_queue_t *node, 
+		  coap_tick_t now) {
+  coap_tick_t rtt;
+
+  if (node->retransmit_cnt)
+    return;
+
+  rtt = now - node->sent;
+  if (reg->srtt && rtt > 2 * reg->srtt) {
+    /* queues are building up, back off gently */
+    if (reg->non_run > COAP_OBS_MIN_NON_RUN)
+      reg->non_run--;
+  } else if (reg->non_run < coap_non_ceiling(reg)) {
+    reg->non_run++;
+  }
+
+  if (reg->srtt)
+    reg->srtt = (7 * reg->srtt + rtt) / 8;
+  else
+    reg->srtt = rtt;
+}
+
+/* Halves the NON run of reg when a confirmable notification had to be
+ * retransmitted. */
+static inline void
+coap_notify_lost(coap_registration_t *reg) {
+  reg->non_run /= 2;
+  if (reg->non_run < COAP_OBS_MIN_NON_RUN)
+    reg->non_run = COAP_OBS_MIN_NON_RUN;
+}
+
+/* Sends pdu to the subscriber of reg. The storage of pdu is released
+ * unless it has been placed in the sendqueue. */
+static coap_tid_t
+coap_notify_impl(coap_context_t *context, coap_pdu_t *pdu, 
+		 coap_registration_t *reg, coap_tick_t now) {
+  coap_tid_t tid;
+  ze_payload_header_t header;
+  size_t len;
+
+  if (reg->pmax) {
+    coap_delete_pdu(reg->last);
+    reg->last = coap_pdu_clone(pdu);
+  }
+
+  /* keep what the sender report needs, pdu may be released below */
+  len = pdu->length - (pdu->data - (unsigned char *)pdu->hdr);
+  if (len >= sizeof(header))
+    memcpy(&header, pdu->data, sizeof(header));
+
+  if (pdu->hdr->type == COAP_MESSAGE_CON) {
+    tid = coap_notify_confirmed(context, &reg->subscriber, pdu, reg);
+    if (tid != COAP_INVALID_TID)
+      coap_registration_checkout(reg); /* held by the sendqueue node */
+    else
+      coap_delete_pdu(pdu);
+  } else {
+    pdu->hdr->id = coap_new_peer_message_id(context, &reg->subscriber);
+    tid = coap_send(context, &reg->subscriber, pdu);
+    coap_delete_pdu(pdu);
+  }
+
+  if (tid != COAP_INVALID_TID) {
+    if (reg->last_notify)
+      reg->gap = reg->gap ? (7 * reg->gap + now - reg->last_notify) / 8
+	: now - reg->last_notify;
+    reg->last_notify = now;
+    coap_metric_add(context, COAP_METRIC_NOTIFY, 1);
+    if (len >= sizeof(header))
+      coap_sr_update(context, reg, header.sensor_type, len, now);
+  }
+
+  return tid;
+}
+
+/* Sends pdu to the subscriber of reg unless it must be held back. */
+static coap_tid_t
+coap_notify_send(coap_context_t *context, coap_pdu_t *pdu, 
+		 coap_registration_t *reg, coap_tick_t now) {
+  /* every non_run-th notification checks that the observer is alive */
+  if (reg->non && pdu->hdr->type == COAP_MESSAGE_NON) {
+    if (reg->non_run > coap_non_ceiling(reg))
+      reg->non_run = coap_non_ceiling(reg);
+    if (reg->non_cnt >= reg->non_run)
+      pdu->hdr->type = COAP_MESSAGE_CON;
+    else
+      reg->non_cnt++;
+  }
+  if (pdu->hdr->type == COAP_MESSAGE_CON)
+    reg->non_cnt = 0;
+
+  /* A held back confirmable notification must not be downgraded
+   * by the one that replaces it. */
+  if (reg->pending) {
+    if (reg->pending->hdr->type == COAP_MESSAGE_CON)
+      pdu->hdr->type = COAP_MESSAGE_CON;
+    coap_delete_pdu(reg->pending);
+    reg->pending = NULL;
+  }
+
+  if (coap_notify_blocked(reg, pdu, now)) {
+    reg->pending = pdu;
+    return COAP_NOTIFY_DEFERRED;
+  }
+
+  if (context->notify_rate) {
+    /* the scheduler sends it */
+    reg->pending = pdu;
+    coap_notify_enqueue(context, reg);
+    return COAP_NOTIFY_DEFERRED;
+  }
+
+  return coap_notify_impl(context, pdu, reg, now);
+}
+
+/* Sends the aggregate of reg, if any. */
+static coap_tid_t
+coap_agg_flush(coap_context_t *context, coap_registration_t *reg,
+	       coap_tick_t now) {
+  coap_pdu_t *pdu = reg->agg;
+
+  if (!pdu)
+    return COAP_INVALID_TID;
+
+  reg->agg = NULL;
+  reg->agg_cnt = 0;
+  return coap_notify_send(context, pdu, reg, now);
+}
+
+/* Expiry of reg->agg_timer, which holds a reference to reg. */
+static void
+coap_agg_timeout(coap_context_t *context, coap_queue_t *timer) {
+  coap_registration_t *reg = (coap_registration_t *)timer->data;
+  coap_tick_t now;
+
+  now = context->now;
+  if (reg->agg && !reg->invalid) {
+    if (now < reg->agg_deadline) {
+      /* a later aggregate has been started meanwhile */
+      timer->t = reg->agg_deadline;
+      coap_insert_node(&context->sendqueue, timer, _order_timestamp);
+      return;
+    }
+    coap_agg_flush(context, reg, now);
+    coap_registration_reschedule(context, reg);
+  }
+
+  reg->agg_timer = NULL;
+  coap_delete_node(timer);
+  coap_registration_drop(context, reg);
+}
+
+/* Adds the payload of pdu to the aggregate of reg, starting a new one
+ * if needed. */
+static coap_tid_t
+coap_aggregate(coap_context_t *context, coap_pdu_t *pdu, 
+	       coap_registration_t *reg, coap_tick_t now) {
+  size_t offset = pdu->data - (unsigned char *)pdu->hdr;
+  size_t len = pdu->length - offset;
+  ze_payload_header_t header;
+  coap_pdu_t *agg;
+  coap_tid_t tid = COAP_NOTIFY_DEFERRED;
+
+  if (len < sizeof(header) || len > 255 ||
+      offset + sizeof(header) + 2 + len > COAP_MAX_PDU_SIZE) {
+    /* cannot be aggregated, but must not overtake earlier samples */
+    coap_agg_flush(context, reg, now);
+    return coap_notify_send(context, pdu, reg, now);
+  }
+
+  if (reg->agg && reg->agg->length + 1 + len > reg->agg->max_size)
+    coap_agg_flush(context, reg, now);
+
+  if (!reg->agg) {
+    agg = coap_pdu_init(0, 0, 0, COAP_MAX_PDU_SIZE);
+    if (!agg)
+      return coap_notify_send(context, pdu, reg, now);
+
+    memcpy(agg->hdr, pdu->hdr, offset);
+    agg->data = (unsigned char *)agg->hdr + offset;
+
+    memcpy(&header, pdu->data, sizeof(header));
+    header.packet_type = DATAPOINT_AGGREGATE;
+    memcpy(agg->data, &header, sizeof(header));
+    agg->data[sizeof(header)] = 0;	/* sample count */
+    agg->length = offset + sizeof(header) + 1;
+
+    reg->agg = agg;
+    reg->agg_cnt = 0;
+    reg->agg_deadline = now + (reg->agg_time ? reg->agg_time
+	       : COAP_OBS_AGG_DELAY * COAP_TICKS_PER_SECOND / 1000);
+
+    if (!reg->agg_timer) {
+      reg->agg_timer = 
+	coap_new_timer(context, reg->agg_deadline, coap_agg_timeout, reg);
+      if (reg->agg_timer)
+	coap_registration_checkout(reg);
+    } else if (reg->agg_deadline < reg->agg_timer->t) {
+      coap_reschedule_timer(context, reg->agg_timer, reg->agg_deadline);
+    }
+  }
+
+  agg = reg->agg;
+  if (pdu->hdr->type == COAP_MESSAGE_CON)
+    agg->hdr->type = COAP_MESSAGE_CON;
+
+  ((unsigned char *)agg->hdr)[agg->length] = len;
+  memcpy((unsigned char *)agg->hdr + agg->length + 1, pdu->data, len);
+  agg->length += 1 + len;
+  agg->data[sizeof(header)] = ++reg->agg_cnt;
+  coap_delete_pdu(pdu);
+
+  if ((reg->agg_max && reg->agg_cnt >= reg->agg_max) || !reg->agg_timer)
+    tid = coap_agg_flush(context, reg, now);
+
+  return tid;
+}
+
+coap_tid_t
+coap_notify(coap_context_t *context, coap_pdu_t *pdu, 
+	    coap_registration_t *reg) {
+  coap_tick_t now;
+  coap_tid_t tid;
+
+  if (!context || !pdu || !reg || reg->invalid) {
+    coap_delete_pdu(pdu);
+    return COAP_INVALID_TID;
+  }
+
+  now = coap_clock_update(context);
+  if (reg->agg_max > 1 || reg->agg_time) {
+    tid = coap_aggregate(context, pdu, reg, now);
+  } else {
+    /* aggregation may have been turned off by a new registration */
+    coap_agg_flush(context, reg, now);
+    tid = coap_notify_send(context, pdu, reg, now);
+  }
+
+  coap_registration_reschedule(context, reg);
+  return tid;
+}
+
+/* Returns a copy of the last notification of reg under the next
+ * Observe sequence number, so that the observer does not take the
+ * refresh for a stale one (RFC 7641, section 3.4). */
+static coap_pdu_t *
+coap_notify_repeat(coap_registration_t *reg) {
+  coap_opt_iterator_t opt_iter;
+  coap_opt_t *opt;
+  coap_pdu_t *pdu;
+  unsigned char obs[2];
+  size_t len;
+
+  pdu = coap_pdu_init(reg->last->hdr->type, reg->last->hdr->code, 0,
+		      COAP_MAX_PDU_SIZE);
+  if (!pdu)
+    return NULL;
+
+  reg->notcnt++;
+  coap_sr_put(obs, (unsigned short)reg->notcnt, 2);
+
+  coap_option_iterator_init(reg->last, &opt_iter, COAP_OPT_ALL);
+  while ((opt = coap_option_next(&opt_iter))) {
+    if (opt_iter.type == COAP_OPTION_SUBSCRIPTION)
+      coap_add_option(pdu, opt_iter.type, sizeof(obs), obs);
+    else
+      coap_add_option(pdu, opt_iter.type, 
+		      coap_opt_length(opt), coap_opt_value(opt));
+  }
+
+  len = reg->last->length - (reg->last->data - (unsigned char *)reg->last->hdr);
+  if (len)
+    coap_add_data(pdu, len, reg->last->data);
+  return pdu;
+}
+
+void
+coap_check_registration(coap_context_t *context, coap_registration_t *reg) {
+  coap_tick_t now;
+  coap_pdu_t *pdu;
+
+  if (reg->invalid) {
+    coap_delete_pdu(reg->pending);
+    reg->pending = NULL;
+    coap_registration_reschedule(context, reg);
+    return;
+  }
+
+  now = context->now;
+  if (reg->pending) {
+    if (coap_notify_blocked(reg, reg->pending, now)) {
+      /* wait for pmin or an ACK */
+    } else if (context->notify_rate) {
+      coap_notify_enqueue(context, reg);
+    } else {
+      pdu = reg->pending;
+      reg->pending = NULL;
+      coap_notify_impl(context, pdu, reg, now);
+    }
+  } else if (reg->pmax && reg->last && now - reg->last_notify >= reg->pmax) {
+    /* nothing sent for pmax, repeat the last representation */
+    pdu = coap_notify_repeat(reg);
+    if (pdu) {
+      pdu->hdr->type = COAP_MESSAGE_CON;
+      coap_notify_send(context, pdu, reg, now);
+    }
+  }
+
+  coap_registration_reschedule(context, reg);
 }
 
+void
+coap_check_due(coap_context_t *context) {
+  coap_registration_t *reg;
+  unsigned int n = context->due.count;
+
+  /* n bounds the work for registrations that stay due because
+   * nothing could be sent */
+  while (context->due.count && context->due.reg[0]->due <= context->now) {
+    reg = context->due.reg[0];
+    if (!reg->due)		/* nothing to do any more */
+      coap_heap_pop(context, &context->due);
+    else if (n--)
+      coap_check_registration(context, reg);
+    else
+      break;
+  }
+}
+
+void
+coap_schedule_notifications(coap_context_t *context) {
+  coap_resource_t *r;
+  coap_registration_t *reg;
+  coap_tick_t now;
+  size_t burst;
+
+  if (!context->notify_rate)
+    return;
+
+  /* refill the credit, allowing for bursts of 1/8 second */
+  now = coap_clock_update(context);
+  burst = context->notify_rate / 8;
+  if (burst < COAP_MAX_PDU_SIZE)
+    burst = COAP_MAX_PDU_SIZE;
+  if (now - context->notify_refill > COAP_TICKS_PER_SECOND)
+    context->notify_refill = now - COAP_TICKS_PER_SECOND;
+  context->notify_credit += (unsigned long long)context->notify_rate 
+    * (now - context->notify_refill) / COAP_TICKS_PER_SECOND;
+  if (context->notify_credit > burst)
+    context->notify_credit = burst;
+  context->notify_refill = now;
+
+  /* Deficit round robin over the resources in the round robin list.
+   * The resource at the head keeps its place and its quantum when the
+   * credit runs out, so that the next call resumes with it. */
+  while ((r = context->notify_head)) {
+    if (!r->notify_granted) {
+      r->notify_granted = 1;
+      r->deficit += COAP_NOTIFY_QUANTUM * (r->weight ? r->weight : 1);
+    }
+
+    while ((reg = r->notify_queue)) {
+      coap_pdu_t *pdu = reg->pending;
+
+      if (pdu && !reg->invalid && !coap_notify_blocked(reg, pdu, now)) {
+	if (pdu->length > r->deficit)
+	  break;
+
+	if (pdu->length > context->notify_credit)
+	  return;
+
+	r->deficit -= pdu->length;
+	context->notify_credit -= pdu->length;
+	reg->pending = NULL;
+	coap_notify_impl(context, pdu, reg, now);
+      }
+
+      /* sent, or held back again until coap_check_registration()
+       * queues it anew */
+      r->notify_queue = reg->notify_next;
+      reg->notify_next = NULL;
+      reg->notify_queued = 0;
+      coap_registration_reschedule(context, reg);
+      coap_registration_release(r, reg);
+    }
+
+    /* the round of r is over, it goes to the tail while it has
+     * notifications left */
+    r->notify_granted = 0;
+    context->notify_head = r->notify_next;
+    r->notify_next = NULL;
+    if (r->notify_queue) {
+      if (context->notify_head)
+	context->notify_tail->notify_next = r;
+      else
+	context->notify_head = r;
+      context->notify_tail = r;
+    } else {
+      /* idle resources must not save up deficit */
+      r->notify_active = 0;
+      r->deficit = 0;
+    }
+  }
+}
+
+#ifndef WITH_CONTIKI
+/* Drops the references the notification scheduler and the due heap
+ * hold, while the resources of the registrations can still be
+ * found. */
+static void
+coap_notify_clear(coap_context_t *context) {
+  coap_resource_t *r;
+  coap_registration_t *reg;
+
+  while ((r = context->notify_head)) {
+    while ((reg = r->notify_queue)) {
+      r->notify_queue = reg->notify_next;
+      reg->notify_next = NULL;
+      reg->notify_queued = 0;
+      coap_registration_release(r, reg);
+    }
+    context->notify_head = r->notify_next;
+    r->notify_next = NULL;
+    r->notify_active = 0;
+    r->notify_granted = 0;
+  }
+
+  while (context->due.count)
+    coap_heap_pop(context, &context->due);
+  while (context->sr.count)
+    coap_heap_pop(context, &context->sr);
+}
+#endif /* WITH_CONTIKI */
+
+
+/* Removes the notification in node from the system after its deadline
+ * has passed. */
+static void
+coap_notify_expire(coap_context_t *context, coap_queue_t *node) {
+  debug("** transaction %d expired, removed\n", node->id);
+
+  coap_peer_drain(context, node);
+  coap_notify_stale(context, node);
+  coap_delete_node(node);
+}
+
+/* Replaces the notification in node by the one held back for its
+ * registration, keeping the message id. The observer receives the
+ * freshest sample with the retransmission, and the held back one is
+ * not sent on its own later. */
+static void
+coap_notify_refresh(coap_context_t *context, coap_queue_t *node) {
+  coap_registration_t *reg = node->reg;
+  coap_pdu_t *pdu = reg->pending;
+  ze_payload_header_t header;
+  size_t len;
+
+  reg->pending = NULL;
+  pdu->hdr->id = node->pdu->hdr->id;
+  pdu->hdr->type = COAP_MESSAGE_CON;
+  coap_delete_pdu(node->pdu);
+  node->pdu = pdu;
+
+  reg->last_notify = context->now;
+  node->deadline = coap_notify_deadline(reg, pdu, context->now);
+  if (reg->pmax) {
+    coap_delete_pdu(reg->last);
+    reg->last = coap_pdu_clone(pdu);
+  }
+
+  /* the sample goes out with the retransmission */
+  len = pdu->length - (pdu->data - (unsigned char *)pdu->hdr);
+  if (len >= sizeof(header)) {
+    memcpy(&header, pdu->data, sizeof(header));
+    coap_sr_update(context, reg, header.sensor_type, len, context->now);
+  }
+  coap_registration_reschedule(context, reg);
+}
 
 coap_tid_t
 coap_retransmit( coap_context_t *context, coap_queue_t *node ) {
   if ( !context || !node )
     return COAP_INVALID_TID;
 
+  coap_clock_update(context);
+
+  /* timers carry no PDU, their handler takes over the node */
+  if ( !node->pdu ) {
+    if ( node->handler )
+      node->handler(context, node);
+    else
+      coap_delete_node(node);
+    return COAP_INVALID_TID;
+  }
+
+  /* stale notifications are not repeated */
+  if ( node->reg && node->deadline && context->now >= node->deadline ) {
+    coap_notify_expire(context, node);
+    return COAP_INVALID_TID;
+  }
+
   /* re-initialize timeout when maximum number of retransmissions are not reached yet */
   if ( node->retransmit_cnt < COAP_DEFAULT_MAX_RETRANSMIT ) {
+    if ( node->reg && !node->retransmit_cnt )
+      coap_notify_lost(node->reg);
+    if ( node->reg && node->reg->refresh && node->reg->pending )
+      coap_notify_refresh(context, node);
     node->retransmit_cnt++;
-    node->t += ( node->timeout << node->retransmit_cnt );
+    /* backoff is in units of 1/2, see coap_peer_backoff() */
+    node->timeout = node->timeout * node->backoff / 2;
+    node->t += node->timeout;
     coap_insert_node( &context->sendqueue, node, _order_timestamp );
 
-    RETR_counter++;
+    coap_metric_add(context, COAP_METRIC_RETRANSMIT, 1);
+    coap_probe(retransmit, ntohs(node->pdu->hdr->id), node->peer,
+	       node->retransmit_cnt, node->pdu->length);
 
     //They'll all have our payload header..
 	ze_payload_header_t *pay = (ze_payload_header_t *)node->pdu->data;
-	if (pay->sensor_type == ASENSOR_TYPE_ACCELEROMETER)
-		ACCEL_RETR_counter++;
-	else if (pay->sensor_type == ASENSOR_TYPE_LIGHT)
-		LIGHT_RETR_counter++;
-	else if (pay->sensor_type == ASENSOR_TYPE_GYROSCOPE)
-		GYRO_RETR_counter++;
-	else if (pay->sensor_type == ASENSOR_TYPE_PROXIMITY)
-		PROX_RETR_counter++;
 
 	/* only for testing purposes in order to distinguish at the
 	 * client side which are first-time or retransmitted packets. */
@@ -756,8 +2010,8 @@ coap_retransmit( coap_context_t *context, coap_queue_t *node ) {
 #ifndef WITH_CONTIKI
     debug("** retransmission #%d of transaction %d\n",
 	  node->retransmit_cnt, ntohs(node->pdu->hdr->id));
-    LOGI("** retransmission #%d of transaction %d nodeid%d\n",
-	  node->retransmit_cnt, /*ntohs(*/node->pdu->hdr->id/*)*/, node->id);
+    coap_trace(COAP_TRACE_RETRANSMIT, ntohs(node->pdu->hdr->id), 
+	       node->id, node->retransmit_cnt);
 #else /* WITH_CONTIKI */
     debug("** retransmission #%u of transaction %u\n",
 	  node->retransmit_cnt, uip_ntohs(node->pdu->hdr->id));
@@ -768,6 +2022,8 @@ coap_retransmit( coap_context_t *context, coap_queue_t *node ) {
   }
 
   /* no more retransmissions, remove node from system */
+  coap_peer_drain(context, node);
+  coap_peer_failed(context, coap_node_peer(context, node));
 
   debug("** transaction %d unsuccessful, removed\n", node->id);
 
@@ -783,12 +2039,14 @@ coap_retransmit( coap_context_t *context, coap_queue_t *node ) {
       token.s = COAP_OPT_VALUE(opt_iter.option);
     }
 
-    if (node->reg != NULL)
+    if (node->reg != NULL) {
+    	coap_notify_done(node->reg);
     	/* This takes care of the resource-specific unregistration procedure
     	 * (if it's the first confirmable message that tops the fail count)
     	 * as well as releasing the registration.
     	 */
     	coap_handle_failed_notify(context, node->reg, &node->remote, &token);
+    }
   }
 #endif /* WITHOUT_OBSERVE */
 
@@ -898,6 +2156,7 @@ coap_read( coap_context_t *ctx ) {
   ssize_t bytes_read = -1;
   coap_address_t src, dst;
   coap_queue_t *node;
+  coap_peer_t *peer;
 
 #ifdef WITH_CONTIKI
   buf = uip_appdata;
@@ -907,8 +2166,8 @@ coap_read( coap_context_t *ctx ) {
   coap_address_init(&src);
 
 #ifndef WITH_CONTIKI
-  bytes_read = recvfrom(ctx->sockfd, buf, sizeof(buf), 0,
-			&src.addr.sa, &src.size);
+  bytes_read = ctx->transport->recv(ctx->transport, &src,
+				    (unsigned char *)buf, sizeof(buf));
 #else /* WITH_CONTIKI */
   if(uip_newdata()) {
     uip_ipaddr_copy(&src.addr, &UIP_IP_BUF->srcipaddr);
@@ -925,7 +2184,7 @@ coap_read( coap_context_t *ctx ) {
 #endif /* WITH_CONTIKI */
 
   if ( bytes_read < 0 ) {
-    warn("coap_read: recvfrom");
+    warn("coap_read: %s recv\n", ctx->transport->name);
     return -1;
   }
 
@@ -947,7 +2206,7 @@ coap_read( coap_context_t *ctx ) {
   if (!node->pdu)
     goto error;
 
-  coap_ticks( &node->t );
+  node->t = coap_clock_update(ctx);
   memcpy(&node->local, &dst, sizeof(coap_address_t));
   memcpy(&node->remote, &src, sizeof(coap_address_t));
 
@@ -1007,7 +2266,15 @@ coap_read( coap_context_t *ctx ) {
   }
 
   /* and add new node to receive queue */
-  coap_transaction_id(&node->remote, node->pdu, &node->id);
+  peer = coap_peer_get(ctx, &node->remote);
+  if (peer) {
+    node->peer = peer->id;
+    coap_transaction_id_from_key(peer->key, node->pdu, &node->id);
+  } else {
+    coap_transaction_id(&node->remote, node->pdu, &node->id);
+  }
+  coap_probe(receive, ntohs(node->pdu->hdr->id), node->peer,
+	     node->pdu->hdr->type, bytes_read);
   coap_insert_node(&ctx->recvqueue, node, _order_timestamp);
 
 #ifndef NDEBUG
@@ -1181,7 +2448,8 @@ wellknown_response(coap_context_t *context, coap_pdu_t *request) {
 void
 handle_request(coap_context_t *context, coap_queue_t *node) {
 
-	LOGI("Incoming REQUEST id%d mid%u", node->id, node->pdu->hdr->id);
+	coap_trace(COAP_TRACE_REQUEST, ntohs(node->pdu->hdr->id), node->id,
+		   node->pdu->hdr->code);
 
   coap_method_handler_t h = NULL;
   coap_pdu_t *response = NULL;
@@ -1234,6 +2502,7 @@ handle_request(coap_context_t *context, coap_queue_t *node) {
 
 		return;
   }
+  resource->requests++;
   
   /* the resource was found, check if there is a registered handler */
   /* h is the registered handler in this case */
@@ -1266,7 +2535,34 @@ handle_request(coap_context_t *context, coap_queue_t *node) {
 				token.s = COAP_OPT_VALUE(opt_iter.option);
 			  }
 
+			  coap_tick_t start, end;
+
+			  coap_probe(handler_entry, ntohs(node->pdu->hdr->id), node->peer,
+				     node->pdu->hdr->code, node->pdu->length);
+			  coap_ticks(&start);
 			  h(context, resource, &node->remote, node->pdu, &token, response);
+			  coap_ticks(&end);
+			  coap_probe(handler_exit, ntohs(node->pdu->hdr->id), node->peer,
+				     response->hdr->code, response->length);
+			  coap_latency_add(context, COAP_LATENCY_HANDLER, end - start);
+
+#ifndef WITHOUT_OBSERVE
+			  /* pick up the notification attributes of a new or
+			   * refreshed registration */
+			  if (node->pdu->hdr->code == COAP_REQUEST_GET &&
+			      coap_check_option(node->pdu, COAP_OPTION_SUBSCRIPTION, &opt_iter)) {
+				coap_registration_t *reg;
+				reg = coap_find_registration(resource, &node->remote);
+				coap_peer_t *peer =
+				  coap_peer_by_id(&context->peers, node->peer);
+				if (reg && peer) {
+				  coap_registration_bind(reg, peer);
+				  coap_registration_parse_query(reg, node->pdu);
+				  coap_lease_refresh(context, reg);
+				  coap_registration_reschedule(context, reg);
+				}
+			  }
+#endif /* WITHOUT_OBSERVE */
 
 			  /* TODO would be convenient to add to the alive mids
 			   * before actually processing the request in its handler h(.)
@@ -1275,11 +2571,12 @@ handle_request(coap_context_t *context, coap_queue_t *node) {
 			   */
 
 			  /* Not strictly necessary but helpful. */
-		      coap_clean_expired_mids(context->alive_mids);
+		      coap_clean_expired_mids(context);
 
 			  coap_alive_mid_t *newmid = coap_mid_alive_init();
-			  newmid->expiry = get_ntp() + EXCHANGE_LIFETIME*1000000000LL;
+			  newmid->expiry = context->now + EXCHANGE_LIFETIME * COAP_TICKS_PER_SECOND;
 			  newmid->peer = node->remote;
+			  newmid->peer_id = node->peer;
 			  newmid->mid = node->pdu->hdr->id;
 			  newmid->type = -1; //request was NON, ACK/RST to this request undefined
 			  // if response is NON it means that the request was NON
@@ -1328,7 +2625,8 @@ static inline void
 handle_response(coap_context_t *context, 
 		coap_queue_t *sent, coap_queue_t *rcvd) {
 
-	LOGI("Incoming RESPONSE");
+	coap_trace(COAP_TRACE_RESPONSE, ntohs(rcvd->pdu->hdr->id), rcvd->id,
+		   rcvd->pdu->hdr->code);
   
   /* Call application-specific reponse handler when available.  If
    * not, we must acknowledge confirmable messages. */
@@ -1355,7 +2653,6 @@ handle_locally(coap_context_t *context, coap_queue_t *node) {
 
 coap_alive_mid_t *
 coap_mid_alive_init() {
-	LOGW("initializing alive mid record");
 	coap_alive_mid_t *temp = malloc(sizeof(coap_alive_mid_t));
 	if (temp == NULL) return NULL;
 	memset(temp, 0, sizeof(coap_alive_mid_t));
@@ -1364,13 +2661,12 @@ coap_mid_alive_init() {
 }
 
 void
-coap_clean_expired_mids(coap_alive_mid_t *list) {
-	int64_t now = get_ntp();
+coap_clean_expired_mids(coap_context_t *context) {
 	coap_alive_mid_t *c, *p;
-	LL_FOREACH_SAFE(list, c, p) {
-		if(c->expiry < now) {
-			LOGW("mid:%u expired, deleting", ntohs(c->mid));
-			LL_DELETE(list, c);
+	LL_FOREACH_SAFE(context->alive_mids, c, p) {
+		if(c->expiry < context->now) {
+			coap_trace(COAP_TRACE_MID_EXPIRED, ntohs(c->mid), 0, 0);
+			LL_DELETE(context->alive_mids, c);
 			free(c);
 		}
 	}
@@ -1379,11 +2675,11 @@ coap_clean_expired_mids(coap_alive_mid_t *list) {
 /* Compares the source address, too, as per CoAP standard. */
 coap_alive_mid_t *
 mid_is_alive(coap_context_t *context, coap_queue_t *rcvd) {
-	LOGW("checking if the just received mid is alive");
 	coap_alive_mid_t *t;
 	LL_FOREACH(context->alive_mids, t) {
 		if ( rcvd->pdu->hdr->id == t->mid &&
-				coap_address_equals(&rcvd->remote, &t->peer) ) {
+				(rcvd->peer && t->peer_id ? rcvd->peer == t->peer_id
+				 : coap_address_equals(&rcvd->remote, &t->peer)) ) {
 			LOGW("mid:%u was found alive against:%u", ntohs(rcvd->pdu->hdr->id), ntohs(t->mid));
 			return t;
 		}
@@ -1405,6 +2701,7 @@ coap_dispatch( coap_context_t *context ) {
   coap_address_t dest;
   int queuefound = 0;
   coap_alive_mid_t *t;
+  coap_tick_t now;
 
   //int gotrst = 0;
 
@@ -1415,55 +2712,59 @@ coap_dispatch( coap_context_t *context ) {
 
   while ( context->recvqueue ) {
     rcvd = context->recvqueue;
+    sent = NULL;	/* not every path below looks for a transaction */
 
     /* remove node from recvqueue */
     context->recvqueue = context->recvqueue->next;
     rcvd->next = NULL;
 
+    /* rcvd->t is the time of coap_read() */
+    now = coap_clock_update(context);
+    coap_latency_add(context, COAP_LATENCY_QUEUE, now - rcvd->t);
+    coap_probe(dispatch_start, ntohs(rcvd->pdu->hdr->id), rcvd->peer,
+	       rcvd->pdu->hdr->type, rcvd->pdu->length);
+
     if ( rcvd->pdu->hdr->version != COAP_DEFAULT_VERSION ) {
       debug("dropped packet with unknown version %u\n", rcvd->pdu->hdr->version);
       goto cleanup;
     }
     
-    LOGI("--- Received packet ---------");
-    printpdu(rcvd->pdu);
-	LOGI("-----------------------------");
+    coap_trace(COAP_TRACE_RECV, 
+	       rcvd->pdu->hdr->type << 8 | rcvd->pdu->hdr->code,
+	       ntohs(rcvd->pdu->hdr->id), rcvd->pdu->length);
+    if (coap_trace_on(COAP_TRACE_VERBOSE))
+      printpdu(rcvd->pdu);
 
-
-	/*
-	 * good place to insert here..
-	 */
-	UDP_IN_counter++;
-	UDP_IN_octects += rcvd->pdu->length; //correctly set in coap_read() to recvfrom()'s return value
-
-	if (rcvd->pdu->hdr->type == COAP_MESSAGE_NON) {
-		IN_NON_counter++;
-		IN_NON_octects += rcvd->pdu->length;
-	}
-	else if (rcvd->pdu->hdr->type == COAP_MESSAGE_CON) {
-		IN_CON_counter++;
-		IN_CON_octects += rcvd->pdu->length;
-	}
-	else if (rcvd->pdu->hdr->type == COAP_MESSAGE_ACK) {
-		IN_ACK_counter++;
-		IN_ACK_octects += rcvd->pdu->length;
-	}
-	else if (rcvd->pdu->hdr->type == COAP_MESSAGE_RST) {
-		IN_RST_counter++;
-		IN_RST_octects += rcvd->pdu->length;
-	}
+    /* pdu->length is set to the size of the datagram by coap_read() */
+    coap_metric_add(context, COAP_METRIC_IN_CON + rcvd->pdu->hdr->type, 1);
+    coap_metric_add(context, COAP_METRIC_IN_CON_BYTES + rcvd->pdu->hdr->type,
+		    rcvd->pdu->length);
 
 
     switch ( rcvd->pdu->hdr->type ) {
     case COAP_MESSAGE_ACK:
 
-      LOGI("Incoming ACK mid%u", rcvd->pdu->hdr->id);
 
       /* find transaction in sendqueue to stop retransmission */
       /* Careful that sent could be != NULL even if no element has
        * been found. */
       queuefound = coap_remove_from_queue(&context->sendqueue, rcvd->id, &sent);
 
+      if (queuefound && sent != NULL) {
+    	  coap_peer_t *peer = coap_node_peer(context, sent);
+    	  now = context->now;
+    	  coap_latency_add(context, COAP_LATENCY_ACK, now - sent->sent);
+    	  coap_probe(transaction_complete, ntohs(rcvd->pdu->hdr->id), 
+    		     sent->peer, COAP_MESSAGE_ACK, now - sent->sent);
+    	  if (peer) {
+    		  coap_peer_rtt_sample(peer, now - sent->sent, 
+    				  sent->retransmit_cnt, now);
+    		  coap_peer_rtt_record(peer, now - sent->sent);
+    		  peer->fail_cnt = 0;
+    	  }
+    	  coap_peer_drain(context, sent);
+      }
+
       if (queuefound && sent != NULL && sent->reg != NULL) { //Yes, C uses short-circuit evaluation
 		  /* We now have in sent the entry of the queue that has just been
 		   * detached from the linked list. Though if we sent a normal response
@@ -1474,8 +2775,7 @@ coap_dispatch( coap_context_t *context ) {
 		   * had been created (specifically coap_send_confirmed()
 		   * and coap_notify() functions).
 		   */
-    	  LOGI("Found observe-related transaction id%d mid%u in sendqueue facing ACK id%d mid%u",
-    			  sent->id, sent->pdu->hdr->id, rcvd->id, rcvd->pdu->hdr->id);
+    	  coap_trace(COAP_TRACE_ACK, ntohs(rcvd->pdu->hdr->id), 1, 1);
     	  /* Have to protect to ACK that arrive late, when the failcount
     	   * has already topped and the registration is still in memory and
     	   * in the process of being destroyed. Cannot touch it anymore when is
@@ -1485,14 +2785,18 @@ coap_dispatch( coap_context_t *context ) {
     	   */
     	  if (sent->reg->fail_cnt <= COAP_OBS_MAX_FAIL)
     		  sent->reg->fail_cnt = 0;
+    	  sent->reg->expired_run = 0;
+    	  coap_notify_acked(sent->reg, sent, now);
+    	  /* Send the freshest notification that has been held
+    	   * back while this one was outstanding. */
+    	  coap_notify_done(sent->reg);
+    	  coap_check_registration(context, sent->reg);
     	  res = coap_get_resource_from_key(context, sent->reg->reskey);
     	  if (res != NULL)
     		  coap_registration_release(res, sent->reg);
       }
-      else if (queuefound) LOGI("Found oneshot-related transaction in sendqueue facing ACK id%d mid%u",
-    		  rcvd->id, rcvd->pdu->hdr->id);
-      else LOGI("Not found any transaction in sendqueue facing ACK id%d mid%u",
-    		  rcvd->id, rcvd->pdu->hdr->id);
+      else
+    	  coap_trace(COAP_TRACE_ACK, ntohs(rcvd->pdu->hdr->id), queuefound, 0);
 
       if (rcvd->pdu->hdr->code == 0)
 	goto cleanup;
@@ -1503,10 +2807,6 @@ coap_dispatch( coap_context_t *context ) {
       break;
 
     case COAP_MESSAGE_RST :
-
-    	LOGI("Incoming RST mid%u", rcvd->pdu->hdr->id);
-    	//gotrst = 1;
-
       /* We have sent something the receiver disliked, so we remove
        * not only the transaction but also the subscriptions we might
        * have. */
@@ -1517,43 +2817,48 @@ coap_dispatch( coap_context_t *context ) {
       coap_log(LOG_ALERT, "got RST for message %u\n", uip_ntohs(rcvd->pdu->hdr->id));
 #endif /* WITH_CONTIKI */
 
-
-
-      /* @todo remove observer for this resource, if any 
-       * get token from sent and try to find a matching resource. Uh!
-       * no, no, only resource+destination here as well, there's only one.
-       */
-
       /* Find transaction in sendqueue to stop retransmission */
       queuefound = coap_remove_from_queue(&context->sendqueue, rcvd->id, &sent);
+      if (queuefound && sent != NULL) {
+	coap_probe(transaction_complete, ntohs(rcvd->pdu->hdr->id),
+		   sent->peer, COAP_MESSAGE_RST, context->now - sent->sent);
+	coap_peer_drain(context, sent);
+      }
 
       if (queuefound && sent != NULL && sent->reg != NULL) { //Yes, C uses short-circuit evaluation
-    	  /* A transaction for this message ID has been found;
-    	   * It's a RST and therefore we should not only delete this
-    	   * transaction, but also trigger a stop of the stream. This work
-    	   * is performed by the on_unregister function associated
-    	   * with the resource and therefore we must first
-    	   * identify the resource using sent->reg.
-    	   */
-    	  LOGI("Found observe-related transaction id%d mid%u in sendqueue facing RST id%d mid%u",
-    			  sent->id, sent->pdu->hdr->id, rcvd->id, rcvd->pdu->hdr->id);
-    	  res = coap_get_resource_from_key(context, sent->reg->reskey);
-    	  if (res != NULL ) {
-
-    		  if ((coap_registration_handler_t*)res->on_unregister != NULL
-    				  && !(sent->reg->invalid))
-    			  res->on_unregister(context, sent->reg);
-
-			  /* Release because the pointer that was in the sendqueue's
-			   * transaction is now gone!
-			   */
-			  coap_registration_release(res, sent->reg);
-    	  }
-          else if (queuefound) LOGI("Found oneshot-related transaction in sendqueue facing RST id%d mid%u",
-        		  rcvd->id, rcvd->pdu->hdr->id);
-          else LOGI("Not found any transaction in sendqueue facing RST id%d mid%u",
-        		  rcvd->id, rcvd->pdu->hdr->id);
+	/* A transaction for this message ID has been found;
+	 * It's a RST and therefore we should not only delete this
+	 * transaction, but also trigger a stop of the stream. This work
+	 * is performed by the on_unregister function associated
+	 * with the resource and therefore we must first
+	 * identify the resource using sent->reg.
+	 */
+	coap_trace(COAP_TRACE_RST, ntohs(rcvd->pdu->hdr->id), 1, 1);
+	coap_notify_done(sent->reg);
+	res = coap_get_resource_from_key(context, sent->reg->reskey);
+	if (res != NULL) {
+	  coap_peer_t *peer = coap_node_peer(context, sent);
+
+	  if ((coap_registration_handler_t*)res->on_unregister != NULL
+	      && !(sent->reg->invalid)
+	      && sent->reg->fail_cnt <= COAP_OBS_MAX_FAIL) {
+	    sent->reg->fail_cnt = COAP_OBS_MAX_FAIL + 1;
+	    res->on_unregister(context, sent->reg);
+	  }
+
+	  /* The peer has lost its state, end its other
+	   * registrations as well. */
+	  if (peer)
+	    coap_peer_unregister(context, peer);
+
+	  /* Release because the pointer that was in the sendqueue's
+	   * transaction is now gone!
+	   */
+	  coap_registration_release(res, sent->reg);
+	}
       }
+      else
+	coap_trace(COAP_TRACE_RST, ntohs(rcvd->pdu->hdr->id), queuefound, 0);
 
       break;
 
@@ -1561,10 +2866,13 @@ coap_dispatch( coap_context_t *context ) {
       if (coap_option_check_critical(context, rcvd->pdu, opt_filter) == 0)
     	  goto cleanup;
 
-      coap_clean_expired_mids(context->alive_mids);
+      coap_clean_expired_mids(context);
       t = mid_is_alive(context, rcvd);
       if ( t != NULL ) { //duplicate
-    	  Duplicate_Count++;
+    	  coap_metric_add(context, COAP_METRIC_DUPLICATE, 1);
+    	  coap_trace(COAP_TRACE_DUPLICATE, ntohs(rcvd->pdu->hdr->id), t->type, 0);
+    	  coap_probe(dedup_hit, ntohs(rcvd->pdu->hdr->id), rcvd->peer,
+    		     rcvd->pdu->hdr->type, t->type);
     	  /* Request already processed and no need to send ACK/RST:
     	   * goto cleanup, skipping the request handlers. */
     	  goto cleanup;
@@ -1589,10 +2897,13 @@ coap_dispatch( coap_context_t *context ) {
 		goto cleanup;
       }
 
-      coap_clean_expired_mids(context->alive_mids);
+      coap_clean_expired_mids(context);
       t = mid_is_alive(context, rcvd);
       if ( t != NULL ) { // treat as duplicate
-    	  Duplicate_Count++;
+    	  coap_metric_add(context, COAP_METRIC_DUPLICATE, 1);
+    	  coap_trace(COAP_TRACE_DUPLICATE, ntohs(rcvd->pdu->hdr->id), t->type, 0);
+    	  coap_probe(dedup_hit, ntohs(rcvd->pdu->hdr->id), rcvd->peer,
+    		     rcvd->pdu->hdr->type, t->type);
     	  /* Request already processed but we need to send ACK/RST:
     	   * if the first time it arrived it was a CON as well, we'll know
     	   * how we answered the first time, whether ACK or RST, and replay
@@ -1603,11 +2914,9 @@ coap_dispatch( coap_context_t *context ) {
     	   * and we have to reply something. If we ignore this the sender will retry
     	   * transmission. */
     	  if (t->type == COAP_MESSAGE_ACK) {
-    		  LOGW("Replaying ACK to a duplicate request");
     		  coap_send_ack(context, &rcvd->remote, rcvd->pdu);
     	  }
     	  else {
-    		  LOGW("Replaying RST to a duplicate request");
     		  coap_send_rst(context, &rcvd->remote, rcvd->pdu);
     	  }
 
@@ -1628,7 +2937,8 @@ coap_dispatch( coap_context_t *context ) {
 	handle_response(context, sent, rcvd);
       else {
 	debug("dropped message with invalid code\n");
-	LOGI("dropped message with invalid code");
+	coap_trace(COAP_TRACE_DROPPED, ntohs(rcvd->pdu->hdr->id), 
+		   rcvd->pdu->hdr->code, 0);
 	coap_send_message_type(context, &rcvd->remote, rcvd->pdu, 
 				 COAP_MESSAGE_RST);
       }
@@ -1636,6 +2946,10 @@ coap_dispatch( coap_context_t *context ) {
     //}
     
   cleanup:
+    coap_probe(dispatch_end, ntohs(rcvd->pdu->hdr->id), rcvd->peer,
+	       rcvd->pdu->hdr->type, rcvd->pdu->length);
+    coap_ticks(&now);
+    coap_latency_add(context, COAP_LATENCY_TOTAL, now - rcvd->t);
     coap_delete_node(sent);
     coap_delete_node(rcvd);
   }
@@ -1646,6 +2960,50 @@ coap_can_exit( coap_context_t *context ) {
   return !context || (context->recvqueue == NULL && context->sendqueue == NULL);
 }
 
+#define coap_earliest(Result, Found, T)		\
+  do {						\
+    if (!(Found) || (T) < (Result)) {		\
+      (Result) = (T);				\
+      (Found) = 1;				\
+    }						\
+  } while (0)
+
+int
+coap_next_deadline(coap_context_t *context, coap_tick_t *deadline) {
+  coap_tick_t t = 0, due;
+  int found = 0;
+
+  if (!context)
+    return 0;
+
+  if (context->sendqueue)
+    coap_earliest(t, found, context->sendqueue->t);
+
+  /* records are appended with the same lifetime, the first one
+   * expires first */
+  if (context->alive_mids)
+    coap_earliest(t, found, context->alive_mids->expiry);
+
+  /* registrations that are due, without those with nothing to do */
+  due = coap_due_earliest(context, 0);
+  if (due)
+    coap_earliest(t, found, due);
+
+  /* notifications queued for the scheduler wait for credit only */
+  if (context->notify_head) {
+    if (context->notify_rate && context->notify_credit < COAP_MAX_PDU_SIZE)
+      coap_earliest(t, found, context->notify_refill
+	+ (COAP_MAX_PDU_SIZE - context->notify_credit) 
+	* COAP_TICKS_PER_SECOND / context->notify_rate);
+    else
+      coap_earliest(t, found, context->now);
+  }
+
+  if (found)
+    *deadline = t;
+  return found;
+}
+
 #ifdef WITH_CONTIKI
 
 /*---------------------------------------------------------------------------*/
@@ -1667,7 +3025,7 @@ PROCESS_THREAD(coap_retransmit_process, ev, data)
 	
 	nextpdu = coap_peek_next(&the_coap_context);
 	
-	coap_ticks(&now);
+	now = coap_clock_update(&the_coap_context);
 	while (nextpdu && nextpdu->t <= now) {
 	  coap_retransmit(&the_coap_context, coap_pop_next(&the_coap_context));
 	  nextpdu = coap_peek_next(&the_coap_context);
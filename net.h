@@ -37,6 +37,9 @@
 #include "prng.h"
 #include "pdu.h"
 #include "coap_time.h"
+#include "peer.h"
+#include "metrics.h"
+#include "transport.h"
 
 //#include "asynchronous.h"
 
@@ -47,25 +50,76 @@
 
 #define EXCHANGE_LIFETIME 248 //seconds
 
-int Duplicate_Count;
+#ifndef COAP_DEFAULT_NSTART
+/**
+ * Number of confirmable messages that may be outstanding to one peer
+ * at a time (see coap_set_nstart()).
+ */
+#define COAP_DEFAULT_NSTART 1
+#endif /* COAP_DEFAULT_NSTART */
+
+#ifndef COAP_LEASE_SLOTS
+/** Number of one-second slots of the lease wheel, a power of two. */
+#define COAP_LEASE_SLOTS 256
+#endif /* COAP_LEASE_SLOTS */
+
+#ifndef COAP_NOTIFY_QUANTUM
+/**
+ * Bytes added per round and unit of weight to the deficit of a
+ * resource by the notification scheduler (see coap_set_notify_rate()).
+ * Should not be smaller than the largest notification.
+ */
+#define COAP_NOTIFY_QUANTUM COAP_MAX_PDU_SIZE
+#endif /* COAP_NOTIFY_QUANTUM */
+
+/* Sender report scheduling for streamed registrations, in the spirit
+ * of RTCP (RFC 3550, Section 6.2): reports get COAP_SR_BW_DIVISOR-th
+ * of the bandwidth of the stream they describe. */
+#ifndef COAP_SR_MIN_INTERVAL
+#define COAP_SR_MIN_INTERVAL 5	/**< minimum report interval in seconds */
+#endif
+#ifndef COAP_SR_MAX_INTERVAL
+#define COAP_SR_MAX_INTERVAL 60 /**< maximum report interval in seconds */
+#endif
+#ifndef COAP_SR_BW_DIVISOR
+#define COAP_SR_BW_DIVISOR 20	/**< reports get 1/20 = 5% of the stream */
+#endif
 
 struct coap_queue_t;
 struct coap_registration_t;
+struct coap_context_t;
+
+/**
+ * Handler of a timer in the sendqueue (see coap_new_timer()). The
+ * handler owns @p timer and must either put it back into the
+ * sendqueue with coap_insert_node() or release it with
+ * coap_delete_node().
+ */
+typedef void (*coap_timer_handler_t)(struct coap_context_t *context,
+				     struct coap_queue_t *timer);
 
 typedef struct coap_queue_t {
   struct coap_queue_t *next;
 
   coap_tick_t t;	        /* when to send PDU for the next time */
   unsigned char retransmit_cnt;	/* retransmission counter, will be removed when zero */
-  unsigned int timeout;		/* the randomized timeout value */
+  coap_tick_t timeout;		/* the randomized timeout value */
 
   coap_address_t local;		/**< local address */
   coap_address_t remote;	/**< remote address */
   coap_tid_t id;		/**< unique transaction id */
 
   coap_registration_t *reg; /**< pointer to the registration object */
+  coap_peer_id_t peer;		/**< the peer of remote, if bound */
+
+  coap_tick_t sent;		/**< time of the first transmission */
+  coap_tick_t deadline;		/**< notifications: when the data gets stale */
+  unsigned char backoff;	/**< timeout factor per retransmission, in halves */
+
+  coap_pdu_t *pdu;		/**< the CoAP PDU to send, @c NULL for timers */
 
-  coap_pdu_t *pdu;		/**< the CoAP PDU to send */
+  coap_timer_handler_t handler;	/**< called by coap_retransmit() for timers */
+  void *data;			/**< application data of timers */
 } coap_queue_t;
 
 /* adds node to given queue, ordered by specified order function */
@@ -81,6 +135,30 @@ void coap_delete_all(coap_queue_t *queue);
 /* creates a new node suitable for adding to the CoAP sendqueue */
 coap_queue_t *coap_new_node();
 
+/**
+ * Adds a timer to the sendqueue of @p context that expires at @p t.
+ * Timers are nodes without a PDU: coap_retransmit() passes them to
+ * @p handler instead of sending anything, so the main loop drives
+ * them together with the retransmissions.
+ *
+ * @param context The context whose sendqueue to use.
+ * @param t       The expiry time.
+ * @param handler The function to call on expiry.
+ * @param data    Application data, stored in the @c data field.
+ * @return The timer or @c NULL on error.
+ */
+coap_queue_t *coap_new_timer(struct coap_context_t *context, coap_tick_t t,
+			     coap_timer_handler_t handler, void *data);
+
+/**
+ * Moves @p timer within the sendqueue of @p context to expire at @p
+ * t. Timers are rescheduled lazily: a deadline that moves to a later
+ * time is best picked up by the handler on expiry, so this is only
+ * needed when it moves to an earlier time.
+ */
+void coap_reschedule_timer(struct coap_context_t *context, 
+			   coap_queue_t *timer, coap_tick_t t);
+
 struct coap_resource_t;
 struct coap_context_t;
 
@@ -105,12 +183,26 @@ typedef struct {
 
 typedef struct {
 	struct coap_alive_mid_t *next;
-	int64_t expiry;
+	coap_tick_t expiry;
 	unsigned short mid;
 	coap_address_t peer;
+	coap_peer_id_t peer_id;
 	int type;
 } coap_alive_mid_t;
 
+/**
+ * A binary heap of registrations, ordered by one of their times. The
+ * heap holds a reference to each of its registrations, and each of
+ * them knows its position in the heap.
+ */
+typedef struct {
+  struct coap_registration_t **reg;
+  unsigned int count;
+  unsigned int size;
+  size_t key;		/**< offset of the coap_tick_t the heap is ordered by */
+  size_t pos;		/**< offset of the position + 1, @c 0 if not in it */
+} coap_reg_heap_t;
+
 /** The CoAP stack's global state is stored in a coap_context_t object */
 typedef struct coap_context_t {
   coap_opt_filter_t known_options;
@@ -125,6 +217,13 @@ typedef struct coap_context_t {
 #ifndef WITH_CONTIKI
   int sockfd;			/**< send/receive socket */ //5683, coap default
   int sockfdtest; //5684
+
+  /**
+   * The transport that coap_send_impl() and coap_read() use,
+   * initially @c udp on @c sockfd. See coap_set_transport().
+   */
+  coap_transport_t *transport;
+  coap_transport_t udp;
 #else /* WITH_CONTIKI */
   struct uip_udp_conn *conn;	/**< uIP connection object */
   
@@ -139,10 +238,27 @@ typedef struct coap_context_t {
    * The last message id that was used is stored in this field.  The
    * initial value is set by coap_new_context() and is usually a
    * random value. A new message id can be created with
-   * coap_new_message_id().
+   * coap_new_message_id(). Messages to a known destination should
+   * use coap_new_peer_message_id() instead.
    */ 
   unsigned short message_id;
 
+  /**
+   * The time cached for the current turn of the event loop, see
+   * coap_clock_update(). All timing inside the library (dispatch,
+   * duplicate detection, retransmissions, registrations) uses it
+   * instead of reading the clock again.
+   */
+  coap_tick_t now;
+
+  /** random numbers for message ids, tokens and jitter */
+  coap_prng_t prng;
+
+  /** traffic counters, see coap_metrics_snapshot() */
+  coap_metrics_shard_t metrics[COAP_METRICS_SHARDS];
+  /** latencies of the packet path, see coap_latency_percentile() */
+  coap_histogram_t latency[COAP_LATENCY_MAX];
+
   /**
    * The next value to be used for Observe. This field is global for
    * all resources and will be updated when notifications are created.
@@ -151,6 +267,42 @@ typedef struct coap_context_t {
 
   coap_response_handler_t response_handler;
 
+  /**
+   * Outgoing rate of the notification scheduler in bytes per second,
+   * @c 0 if notifications are sent right away. See
+   * coap_set_notify_rate().
+   */
+  size_t notify_rate;
+  size_t notify_credit;		/**< bytes that may be sent right now */
+  coap_tick_t notify_refill;	/**< last time notify_credit was updated */
+  /** resources with notifications to send, in round robin order */
+  struct coap_resource_t *notify_head;
+  struct coap_resource_t *notify_tail;
+
+  /**
+   * Registrations that have a held back notification or a pmax
+   * refresh coming, ordered by the time they are due. See
+   * coap_check_due().
+   */
+  coap_reg_heap_t due;
+
+  /** registrations with a sender report coming, ordered by @c sr_next */
+  coap_reg_heap_t sr;
+  coap_queue_t *sr_timer;	/**< timer for the next sender report */
+
+  /**
+   * Timing wheel of registration leases. Slot @c i holds the
+   * registrations whose lease ends in a second congruent to @c i
+   * modulo COAP_LEASE_SLOTS, so each expiry check only looks at one
+   * slot. @c lease_timer turns the wheel once a second while it is
+   * not empty; @c lease_cursor is the next second to be checked.
+   */
+  struct coap_registration_t *lease_wheel[COAP_LEASE_SLOTS];
+  coap_tick_t lease_cursor;
+  coap_queue_t *lease_timer;
+
+  coap_peer_table_t peers;	/**< known peers, see coap_peer_get() */
+  unsigned int nstart;		/**< outstanding CONs allowed per peer */
 
   /* Added pointers to support the Streaming
    * Manager communication, pointers to two
@@ -159,7 +311,6 @@ typedef struct coap_context_t {
   ze_sm_response_buf_t *notbuf;
   ze_sm_request_buf_t *smreqbuf;
 
-
 } coap_context_t;
 
 /**
@@ -187,6 +338,52 @@ coap_register_option(coap_context_t *ctx, unsigned char type) {
   coap_option_setb(ctx->known_options, type);
 }
 
+#ifndef WITH_CONTIKI
+/**
+ * Makes @p context send and receive through @p transport, or through
+ * its UDP socket again if @p transport is @c NULL. The context does
+ * not take ownership of @p transport; it must outlive the context or
+ * be replaced before it is released with coap_free_transport().
+ */
+static inline void
+coap_set_transport(coap_context_t *context, coap_transport_t *transport) {
+  context->transport = transport ? transport : &context->udp;
+}
+#endif /* WITH_CONTIKI */
+
+/**
+ * Enables the notification scheduler of @p context. Notifications
+ * passed to coap_notify() are then held back and shared out by
+ * coap_check_notify() at no more than @p rate bytes per second,
+ * using deficit round robin over the resources. The share of each
+ * resource is proportional to its @c weight, so that a busy stream
+ * cannot starve the others. A @p rate of @c 0 disables the scheduler.
+ *
+ * @param context The context to configure.
+ * @param rate    The outgoing notification rate in bytes per second.
+ */
+static inline void
+coap_set_notify_rate(coap_context_t *context, size_t rate) {
+  context->notify_rate = rate;
+  context->notify_credit = rate / 8;
+  coap_ticks(&context->notify_refill);
+}
+
+/**
+ * Sets the number of confirmable messages that may be outstanding to
+ * a single peer. Further confirmable messages are queued at the peer
+ * and sent as earlier ones are acknowledged, time out or are reset.
+ * A confirmable notification replaces the queued notification for
+ * the same registration, if any.
+ *
+ * @param context The context to configure.
+ * @param nstart  The limit, at least @c 1.
+ */
+static inline void
+coap_set_nstart(coap_context_t *context, unsigned int nstart) {
+  context->nstart = nstart ? nstart : 1;
+}
+
 /* Returns the next pdu to send without removing from sendqeue. */
 coap_queue_t *coap_peek_next( coap_context_t *context );
 
@@ -213,6 +410,31 @@ coap_new_message_id(coap_context_t *context) {
 #endif
 }
 
+/**
+ * Returns a new message id for a message to @p dst in network byte
+ * order, taken from the message id space of the peer (see
+ * coap_peer_message_id()). Falls back to coap_new_message_id() if
+ * the peer cannot be created.
+ *
+ * @param context The current coap_context_t object.
+ * @param dst     The destination of the message.
+ * @return A new message id in network byte order.
+ */
+unsigned short coap_new_peer_message_id(coap_context_t *context,
+					const coap_address_t *dst);
+
+/**
+ * Reads the clock into the cached time @p context->now and returns
+ * it. coap_read(), coap_dispatch(), coap_retransmit(), coap_notify()
+ * and coap_check_notify() do this on entry, so an application only
+ * needs it for its own timing.
+ */
+static inline coap_tick_t
+coap_clock_update(coap_context_t *context) {
+  coap_ticks(&context->now);
+  return context->now;
+}
+
 /* CoAP stack context must be released with coap_free_context() */
 void coap_free_context( coap_context_t *context );
 
@@ -246,12 +468,131 @@ coap_notify(coap_context_t *context, str uri, coap_address_t dst,
 		const unsigned char data, unsigned int len, int conf, int rto, int rtc, unsigned char *max_age, int max_age_length);
 */
 
+/**
+ * Sends the confirmable notification @p pdu for @p reg to @p dst,
+ * replacing the notification of @p reg that still waits for NSTART.
+ * The message id of @p pdu is replaced by a new one from the message
+ * id space of the peer (see coap_new_peer_message_id()).
+ */
 coap_tid_t
 coap_notify_confirmed(coap_context_t *context,
 	    const coap_address_t *dst,
 	    coap_pdu_t *pdu,
 	    coap_registration_t *reg);
 
+/** Returned by coap_notify() when the notification has been held back. */
+#define COAP_NOTIFY_DEFERRED -2
+
+#ifndef SENDREPORT
+#define SENDREPORT 2	/**< packet_type of sender reports */
+#endif
+
+#ifndef DATAPOINT_AGGREGATE
+/**
+ * packet_type of aggregated notifications. The payload of such a
+ * notification starts with a ze_payload_header_t of this type,
+ * followed by one byte with the number of samples. Each sample is
+ * then given as one length byte followed by the original payload of
+ * the sample, including its own ze_payload_header_t.
+ */
+#define DATAPOINT_AGGREGATE 4
+#endif
+
+/**
+ * Sends the notification @p pdu to the subscriber of @p reg, obeying
+ * the registration's notification attributes. If the minimum period
+ * @c pmin has not elapsed since the last notification, or if @p pdu
+ * is confirmable and @c max_inflight confirmable notifications are
+ * still unacknowledged, @p pdu is held back and replaces any
+ * notification that was held back before. It is sent by
+ * coap_check_notify() or as soon as the outstanding ACK arrives,
+ * whichever allows it first. When the notification scheduler is
+ * enabled, every notification is left to coap_check_notify() (see
+ * coap_set_notify_rate()). Confirmable notifications are
+ * passed to coap_notify_confirmed(). Unlike coap_send(), this function
+ * always takes over the storage allocated by @p pdu. The message id
+ * of @p pdu is ignored: each notification gets a new one from the
+ * message id space of the subscriber when it is sent.
+ *
+ * If @c non is set in @p reg, non-confirmable notifications are
+ * turned into confirmable ones after @c non_run of them. The run
+ * length grows by one with every confirmable notification that is
+ * acknowledged without retransmission and without a delay spike,
+ * and is halved on every retransmission, within COAP_OBS_MIN_NON_RUN
+ * and COAP_OBS_MAX_NON_RUN. It is further limited so that a
+ * confirmable notification goes out at least every
+ * COAP_OBS_MAX_SILENCE seconds.
+ *
+ * Every confirmable notification gets a deadline after @c freshness
+ * of @p reg or, if that is not set, after its Max-Age. Without
+ * either, it is COAP_OBS_STALE_GAPS times the smoothed time between
+ * notifications, but at most COAP_OBS_MAX_SILENCE seconds. A Max-Age
+ * of 0 means no deadline. A notification is not retransmitted after
+ * its deadline: the freshest sample held back
+ * for @p reg is sent instead, if any, and the next notification is
+ * confirmable. Expired notifications are counted in @c expired and
+ * not as failures, except that an observer that lets more than
+ * COAP_OBS_MAX_FAIL notifications in a row expire is removed as if
+ * they had failed.
+ *
+ * An observer that registered with the Uri-Query attribute @c fresh
+ * gets the notification held back for @p reg with the next
+ * retransmission, under the message id of the original one.
+ *
+ * If the observer has asked for aggregation (see
+ * coap_registration_parse_query()), the payload of @p pdu is added
+ * to a notification of type DATAPOINT_AGGREGATE instead, which is
+ * sent when it holds @c agg_max samples, when the next sample would
+ * not fit into COAP_MAX_PDU_SIZE, or when its first sample has waited
+ * for @c agg_time (COAP_OBS_AGG_DELAY if not set). The aggregate
+ * takes the options of its first sample and is confirmable if any of
+ * its samples was.
+ *
+ * @param context The CoAP context to use.
+ * @param pdu     The notification to send.
+ * @param reg     The registration that is notified.
+ * @return The transaction id of the sent notification, @c
+ *         COAP_NOTIFY_DEFERRED if it was held back or @c
+ *         COAP_INVALID_TID on error.
+ */
+coap_tid_t coap_notify(coap_context_t *context, coap_pdu_t *pdu,
+		       coap_registration_t *reg);
+
+/**
+ * Sends the notification held back for @p reg once @c pmin has
+ * elapsed and no more confirmable notifications are outstanding than
+ * allowed, and repeats the last notification as confirmable message
+ * when nothing has been sent for @c pmax. Afterwards @p reg is
+ * scheduled for the next time it is due, see coap_check_due().
+ *
+ * @param context The CoAP context to use.
+ * @param reg     The registration to check.
+ */
+void coap_check_registration(coap_context_t *context, coap_registration_t *reg);
+
+/**
+ * Calls coap_check_registration() for the registrations whose held
+ * back notification or pmax refresh is due. Registrations are kept
+ * ordered by that time as their state changes, so this only looks at
+ * the ones that are due. This function is called by
+ * coap_check_notify().
+ *
+ * @param context The CoAP context to use.
+ */
+void coap_check_due(coap_context_t *context);
+
+/**
+ * Sends the notifications held back by the notification scheduler
+ * as far as the rate set with coap_set_notify_rate() allows. Every
+ * resource with notifications to send gets a deficit of @c weight
+ * times COAP_NOTIFY_QUANTUM bytes per round. When the rate is used
+ * up, the next call resumes the round where this one stopped. This
+ * function is called by coap_check_notify().
+ *
+ * @param context The CoAP context to use.
+ */
+void coap_schedule_notifications(coap_context_t *context);
+
 
 /** 
  * Creates a new ACK PDU with specified error @p code. The options
@@ -371,6 +712,16 @@ coap_tid_t coap_retransmit( coap_context_t *context, coap_queue_t *node );
  */
 int coap_read( coap_context_t *context );
 
+/**
+ * Calculates the hash key of the transport address @p peer, which is
+ * the start value for the transaction ids of its messages.
+ *
+ * @param peer The address to hash.
+ * @param h    Set to the hash key.
+ * @return @c 1 on success, @c 0 if the address family is unknown.
+ */
+int coap_hash_address(const coap_address_t *peer, coap_key_t h);
+
 /** 
  * Calculates a unique transaction id from given arguments @p peer and
  * @p pdu. The id is returned in @p id.
@@ -437,6 +788,33 @@ void coap_dispatch( coap_context_t *context );
 /** Returns 1 if there are no messages to send or to dispatch in the context's queues. */
 int coap_can_exit( coap_context_t *context );
 
+/**
+ * Computes when @p context needs to run next, so that the caller can
+ * sleep until then instead of polling. This covers retransmissions
+ * and all timers in the sendqueue (sender reports, registration
+ * leases, aggregation), notifications held back by @c pmin or by the
+ * notification scheduler, @c pmax refreshes and the expiry of
+ * duplicate detection records. Registrations are not scanned, the
+ * earliest of them is found near the top of the due heap (see
+ * coap_check_due()). @p context is not modified.
+ * Once the deadline has passed, the caller runs coap_retransmit() for
+ * the nodes that are due and coap_check_notify().
+ *
+ * @param context  The context to check.
+ * @param deadline Set to the time of the next event, which may be in
+ *                 the past.
+ * @return @c 1 if @p deadline has been set, @c 0 if nothing is
+ *         scheduled and the caller may wait for input only.
+ */
+int coap_next_deadline(coap_context_t *context, coap_tick_t *deadline);
+
+/**
+ * Removes the duplicate detection records of @p context that are
+ * older than EXCHANGE_LIFETIME. Called by coap_dispatch() and
+ * coap_check_notify().
+ */
+void coap_clean_expired_mids(coap_context_t *context);
+
 /**
  * Returns the current value of an internal tick counter. The counter
  * counts \c COAP_TICKS_PER_SECOND ticks every second. 
@@ -105,6 +105,23 @@ coap_delete_pdu(coap_pdu_t *pdu) {
 #endif /* WITH_CONTIKI */
 }
 
+coap_pdu_t *
+coap_pdu_clone(const coap_pdu_t *pdu) {
+  coap_pdu_t *result;
+
+  if (!pdu)
+    return NULL;
+
+  result = coap_pdu_init(0, 0, 0, pdu->length);
+  if (result) {
+    memcpy(result->hdr, pdu->hdr, pdu->length);
+    result->length = pdu->length;
+    result->data = (unsigned char *)result->hdr 
+      + (pdu->data - (unsigned char *)pdu->hdr);
+  }
+  return result;
+}
+
 int
 coap_add_option(coap_pdu_t *pdu, unsigned short type, unsigned int len, const unsigned char *data) {
   size_t optsize, cnt;
@@ -247,6 +247,14 @@ coap_pdu_t *coap_new_pdu();
 
 void coap_delete_pdu(coap_pdu_t *);
 
+/**
+ * Creates a copy of @p pdu that is just large enough to hold its
+ * current contents. The storage allocated for the result must be
+ * released with coap_delete_pdu(). This function returns @c NULL on
+ * error.
+ */
+coap_pdu_t *coap_pdu_clone(const coap_pdu_t *pdu);
+
 /**
  * Adds option of given type to pdu that is passed as first parameter. coap_add_option()
  * destroys the PDU's data, so coap_add_data must be called after all options have been
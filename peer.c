@@ -0,0 +1,366 @@
+/* peer.c -- per-peer transmission state
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file peer.c
+ * @brief per-peer transmission state
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "mem.h"
+#include "debug.h"
+#include "prng.h"
+#include "pdu.h"
+#include "net.h"
+#include "metrics.h"
+#include "peer.h"
+
+/** The RTO of peers without any RTT sample. */
+#define COAP_PEER_DEFAULT_RTO \
+  (COAP_DEFAULT_RESPONSE_TIMEOUT * COAP_TICKS_PER_SECOND)
+
+/** Time after which a peer without registrations or confirmable
+ *  messages is removed. */
+#define COAP_PEER_IDLE (EXCHANGE_LIFETIME * COAP_TICKS_PER_SECOND)
+
+#define coap_peer_hash(Key)						\
+  ((unsigned int)coap_prng_mix((uint64_t)(Key)[0] << 24 | (Key)[1] << 16 \
+				| (Key)[2] << 8 | (Key)[3]))
+
+#define coap_peer_bucket(Table, Key)				\
+  (coap_peer_hash(Key) & ((Table)->nbuckets - 1))
+
+/* Doubles the buckets of table. Returns 0 on error. */
+static int
+coap_peer_grow(coap_peer_table_t *table) {
+  coap_peer_t **bucket, *peer, *next;
+  unsigned int i, b, n;
+
+  n = table->nbuckets ? 2 * table->nbuckets : COAP_PEER_BUCKETS;
+  bucket = (coap_peer_t **)malloc(n * sizeof(coap_peer_t *));
+  if (!bucket)
+    return 0;
+  memset(bucket, 0, n * sizeof(coap_peer_t *));
+
+  for (i = 0; i < table->nbuckets; i++) {
+    for (peer = table->bucket[i]; peer; peer = next) {
+      next = peer->hnext;
+      b = coap_peer_hash(peer->key) & (n - 1);
+      peer->hnext = bucket[b];
+      bucket[b] = peer;
+    }
+  }
+
+  free(table->bucket);
+  table->bucket = bucket;
+  table->nbuckets = n;
+  return 1;
+}
+
+/* Gives peer a free id in table, preferring those of removed peers.
+ * Returns 0 on error. */
+static int
+coap_peer_register(coap_peer_table_t *table, coap_peer_t *peer) {
+  coap_peer_t **byid;
+  coap_peer_id_t *free_ids;
+  unsigned int id, size;
+
+  if (table->nfree) {
+    id = table->free_ids[--table->nfree];
+    goto found;
+  }
+
+  if (!table->next_id)
+    table->next_id = 1;
+
+  if (table->next_id >= table->size) {
+    size = table->size ? 2 * table->size : 16;
+    if (size <= table->size || size - 1 > (coap_peer_id_t)~0)
+      return 0;
+    byid = (coap_peer_t **)realloc(table->byid, size * sizeof(coap_peer_t *));
+    if (!byid)
+      return 0;
+    table->byid = byid;
+    free_ids = (coap_peer_id_t *)
+      realloc(table->free_ids, size * sizeof(coap_peer_id_t));
+    if (!free_ids)
+      return 0;
+    table->free_ids = free_ids;
+    memset(byid + table->size, 0, (size - table->size) * sizeof(coap_peer_t *));
+    table->size = size;
+  }
+  id = table->next_id++;
+
+ found:
+  table->byid[id] = peer;
+  peer->id = id;
+  return 1;
+}
+
+static void
+coap_peer_free(coap_peer_t *peer) {
+  coap_delete_all(peer->pending);
+  coap_free(peer->mid_used);
+  coap_free(peer->rtt_hist);
+  coap_free(peer);
+}
+
+/* Takes peer out of table and releases it. */
+static void
+coap_peer_remove(coap_peer_table_t *table, coap_peer_t *peer) {
+  coap_peer_t **p = &table->bucket[coap_peer_bucket(table, peer->key)];
+
+  while (*p != peer)
+    p = &(*p)->hnext;
+  *p = peer->hnext;
+
+  table->byid[peer->id] = NULL;
+  table->free_ids[table->nfree++] = peer->id;
+  table->count--;
+  coap_peer_free(peer);
+}
+
+/* Checks the next COAP_PEER_SWEEP ids of table and removes the peers
+ * that have nothing left to do and have been idle for COAP_PEER_IDLE.
+ * Duplicate detection records live for EXCHANGE_LIFETIME after the
+ * message they record, so none of them refers to such a peer. */
+static void
+coap_peer_sweep(coap_peer_table_t *table, coap_tick_t now) {
+  coap_peer_t *peer;
+  unsigned int n;
+
+  for (n = 0; n < COAP_PEER_SWEEP && table->count; n++) {
+    if (!table->sweep || table->sweep >= table->next_id)
+      table->sweep = 1;
+    peer = table->byid[table->sweep++];
+
+    if (peer && !peer->regs && !peer->outstanding && !peer->pending &&
+	now - peer->last_seen >= COAP_PEER_IDLE) {
+      debug("peer %u idle, removed\n", peer->id);
+      coap_peer_remove(table, peer);
+    }
+  }
+}
+
+static inline coap_peer_t *
+coap_peer_lookup(coap_peer_table_t *table, const coap_address_t *addr,
+		 const coap_key_t key) {
+  coap_peer_t *peer;
+
+  if (!table->nbuckets)
+    return NULL;
+
+  for (peer = table->bucket[coap_peer_bucket(table, key)]; peer;
+       peer = peer->hnext) {
+    if (memcmp(peer->key, key, sizeof(coap_key_t)) == 0 &&
+	coap_address_equals(&peer->addr, addr))
+      return peer;
+  }
+  return NULL;
+}
+
+coap_peer_t *
+coap_peer_find(coap_context_t *context, const coap_address_t *addr) {
+  coap_key_t key;
+
+  coap_hash_address(addr, key);
+  return coap_peer_lookup(&context->peers, addr, key);
+}
+
+coap_peer_t *
+coap_peer_get(coap_context_t *context, const coap_address_t *addr) {
+  coap_peer_table_t *table = &context->peers;
+  coap_peer_t *peer;
+  coap_key_t key;
+  unsigned int b;
+
+  coap_hash_address(addr, key);
+
+  peer = coap_peer_lookup(table, addr, key);
+  if (peer) {
+    peer->last_seen = context->now;
+    return peer;
+  }
+
+  coap_peer_sweep(table, context->now);
+  if (table->count >= 2 * table->nbuckets && !coap_peer_grow(table)) {
+#ifndef NDEBUG
+    coap_log(LOG_WARN, "coap_peer_get: malloc\n");
+#endif
+    if (!table->nbuckets)
+      return NULL;
+  }
+
+  peer = (coap_peer_t *)coap_malloc(sizeof(coap_peer_t));
+  if (!peer) {
+#ifndef NDEBUG
+    coap_log(LOG_WARN, "coap_peer_get: malloc\n");
+#endif
+    return NULL;
+  }
+
+  memset(peer, 0, sizeof(coap_peer_t));
+  memcpy(&peer->addr, addr, sizeof(coap_address_t));
+  memcpy(peer->key, key, sizeof(coap_key_t));
+  peer->last_seen = context->now;
+  peer->rto = COAP_PEER_DEFAULT_RTO;
+  peer->rto_update = context->now;
+  coap_prng_fill(&context->prng, (unsigned char *)&peer->message_id, 
+		 sizeof(unsigned short));
+
+  if (!coap_peer_register(table, peer)) {
+    coap_free(peer);
+    return NULL;
+  }
+
+  b = coap_peer_bucket(table, key);
+  peer->hnext = table->bucket[b];
+  table->bucket[b] = peer;
+  table->count++;
+  return peer;
+}
+
+void
+coap_delete_peers(coap_context_t *context) {
+  coap_peer_table_t *table = &context->peers;
+  unsigned int id;
+
+  for (id = 1; id < table->size; id++) {
+    if (table->byid[id])
+      coap_peer_free(table->byid[id]);
+  }
+
+  free(table->bucket);
+  free(table->byid);
+  free(table->free_ids);
+  memset(table, 0, sizeof(coap_peer_table_t));
+}
+
+/** Number of message ids per block. */
+#define COAP_PEER_MID_BLOCK (0x10000 / COAP_PEER_MID_BLOCKS)
+
+static inline int
+coap_peer_mid_busy(coap_peer_t *peer, unsigned int b, coap_tick_t now) {
+  return peer->mid_used[b] &&
+    now - peer->mid_used[b] < EXCHANGE_LIFETIME * COAP_TICKS_PER_SECOND;
+}
+
+unsigned short
+coap_peer_message_id(coap_peer_t *peer, coap_tick_t now) {
+  unsigned short id = peer->message_id + 1;
+  unsigned int b = id / COAP_PEER_MID_BLOCK, oldest, n;
+
+  if (!peer->mid_used) {
+    peer->mid_used = 
+      (coap_tick_t *)coap_malloc(COAP_PEER_MID_BLOCKS * sizeof(coap_tick_t));
+    if (!peer->mid_used)
+      return peer->message_id = id;
+    memset(peer->mid_used, 0, COAP_PEER_MID_BLOCKS * sizeof(coap_tick_t));
+  }
+
+  /* Entering a block whose last id was used less than
+   * EXCHANGE_LIFETIME ago means the peer might still take the
+   * new message for a duplicate, so such blocks are skipped. */
+  if (id % COAP_PEER_MID_BLOCK == 0) {
+    oldest = b;
+    for (n = 0; n < COAP_PEER_MID_BLOCKS && coap_peer_mid_busy(peer, b, now);
+	 n++) {
+      if (peer->mid_used[b] < peer->mid_used[oldest])
+	oldest = b;
+      b = (b + 1) % COAP_PEER_MID_BLOCKS;
+    }
+
+    if (n == COAP_PEER_MID_BLOCKS) {
+      warn("message ids of peer %u wrap within EXCHANGE_LIFETIME\n", 
+	   peer->id);
+      b = oldest;
+    }
+    id = b * COAP_PEER_MID_BLOCK;
+  }
+
+  peer->mid_used[b] = now ? now : 1;
+  return peer->message_id = id;
+}
+
+coap_tick_t
+coap_peer_rto(coap_peer_t *peer, coap_tick_t now) {
+  coap_tick_t idle = now - peer->rto_update;
+
+  /* Estimates get stale when a peer is quiet, so small RTOs are
+   * doubled and large ones move halfway back to the default. */
+  if (peer->rto < COAP_TICKS_PER_SECOND && idle > 16 * peer->rto) {
+    peer->rto *= 2;
+    peer->rto_update = now;
+  } else if (peer->rto > 3 * COAP_TICKS_PER_SECOND && idle > 4 * peer->rto) {
+    peer->rto = (peer->rto + COAP_PEER_DEFAULT_RTO) / 2;
+    peer->rto_update = now;
+  }
+
+  return peer->rto;
+}
+
+unsigned int
+coap_peer_backoff(coap_tick_t rto) {
+  if (rto < COAP_TICKS_PER_SECOND)
+    return 6;
+  if (rto > 3 * COAP_TICKS_PER_SECOND)
+    return 3;
+  return 4;
+}
+
+/* Updates srtt and rttvar with sample rtt as in RFC 6298 and returns
+ * srtt + k * rttvar. */
+static coap_tick_t
+coap_rtt_update(coap_tick_t *srtt, coap_tick_t *rttvar, coap_tick_t rtt,
+		unsigned int k) {
+  if (!*srtt) {
+    *srtt = rtt;
+    *rttvar = rtt / 2;
+  } else {
+    coap_tick_t delta = *srtt > rtt ? *srtt - rtt : rtt - *srtt;
+    *rttvar = (3 * *rttvar + delta) / 4;
+    *srtt = (7 * *srtt + rtt) / 8;
+  }
+  return *srtt + k * *rttvar;
+}
+
+void
+coap_peer_rtt_sample(coap_peer_t *peer, coap_tick_t rtt,
+		     unsigned int retransmissions, coap_tick_t now) {
+  coap_tick_t rto;
+
+  if (!rtt)
+    rtt = 1;
+
+  if (retransmissions == 0) {
+    rto = coap_rtt_update(&peer->srtt_strong, &peer->rttvar_strong, rtt, 4);
+    peer->rto = (peer->rto + rto) / 2;
+  } else if (retransmissions <= 2) {
+    rto = coap_rtt_update(&peer->srtt_weak, &peer->rttvar_weak, rtt, 1);
+    peer->rto = (3 * peer->rto + rto) / 4;
+  } else {
+    return;
+  }
+
+  if (peer->rto > COAP_PEER_MAX_RTO * COAP_TICKS_PER_SECOND)
+    peer->rto = COAP_PEER_MAX_RTO * COAP_TICKS_PER_SECOND;
+  peer->rto_update = now;
+}
+
+void
+coap_peer_rtt_record(coap_peer_t *peer, coap_tick_t rtt) {
+  if (!peer->rtt_hist) {
+    peer->rtt_hist = (coap_histogram_t *)coap_malloc(sizeof(coap_histogram_t));
+    if (!peer->rtt_hist)
+      return;
+    memset(peer->rtt_hist, 0, sizeof(coap_histogram_t));
+  }
+
+  coap_histogram_add(peer->rtt_hist, rtt);
+}
@@ -0,0 +1,209 @@
+/* peer.h -- per-peer transmission state
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file peer.h
+ * @brief per-peer transmission state
+ */
+
+#ifndef _COAP_PEER_H_
+#define _COAP_PEER_H_
+
+#include "config.h"
+#include "address.h"
+#include "hashkey.h"
+#include "coap_time.h"
+
+/**
+ * @defgroup peer Peers
+ * @{
+ * State kept for every remote endpoint the context talks to. The
+ * retransmission timeout follows CoCoA (draft-ietf-core-cocoa): a
+ * strong estimator is fed by exchanges that needed no retransmission,
+ * a weak estimator by exchanges that needed one or two, each measured
+ * from the first transmission. Both are combined into the overall RTO
+ * of the peer, which ages back towards the default when no samples
+ * arrive.
+ *
+ * Peers are interned in a hash table of the context, keyed by the
+ * same address hash that coap_transaction_id() uses, and get a small
+ * id. Queue nodes, registrations and duplicate detection records
+ * refer to their peer by id, and the cached hash saves rehashing the
+ * address for every transaction id. The table doubles its buckets as
+ * it fills up. A peer that has no registrations and no confirmable
+ * messages left and has not been seen for EXCHANGE_LIFETIME is
+ * removed, so that no duplicate detection record refers to it any
+ * more; its id is then given to a new peer.
+ *
+ * Liveness is tracked per peer as well: each peer lists its
+ * registrations, so that all of them can be ended at once when the
+ * peer stops acknowledging or resets a notification.
+ */
+
+#ifndef COAP_PEER_BUCKETS
+/** Initial number of hash buckets of the peer table, a power of two.
+ *  The table doubles them when it holds more than two peers per
+ *  bucket. */
+#define COAP_PEER_BUCKETS 32
+#endif /* COAP_PEER_BUCKETS */
+
+#ifndef COAP_PEER_SWEEP
+/** Number of peers checked for idleness whenever a new peer is
+ *  added, see coap_peer_get(). */
+#define COAP_PEER_SWEEP 2
+#endif /* COAP_PEER_SWEEP */
+
+/** Small integer naming a peer, see coap_peer_by_id(). */
+typedef unsigned int coap_peer_id_t;
+
+/** The peer id of nodes and registrations not bound to a peer. */
+#define COAP_PEER_NONE 0
+
+#ifndef COAP_PEER_MID_BLOCKS
+/** Number of blocks the message id space of a peer is divided into
+ *  to avoid reuse within EXCHANGE_LIFETIME, a power of two. */
+#define COAP_PEER_MID_BLOCKS 64
+#endif /* COAP_PEER_MID_BLOCKS */
+
+#ifndef COAP_PEER_MAX_RTO
+/** Upper bound for the RTO of a peer in seconds. */
+#define COAP_PEER_MAX_RTO 32
+#endif /* COAP_PEER_MAX_RTO */
+
+typedef struct coap_peer_t {
+  struct coap_peer_t *hnext;	/**< next peer in the same bucket */
+  coap_peer_id_t id;		/**< the id of this peer */
+  coap_key_t key;		/**< address hash, see coap_hash_address() */
+  coap_address_t addr;		/**< the address of the peer */
+  coap_tick_t last_seen;	/**< last lookup with coap_peer_get() */
+
+  coap_tick_t rto;		/**< overall retransmission timeout */
+  coap_tick_t rto_update;	/**< when rto was last updated */
+
+  coap_tick_t srtt_strong;	/**< smoothed RTT, strong estimator */
+  coap_tick_t rttvar_strong;	/**< RTT variation, strong estimator */
+  coap_tick_t srtt_weak;	/**< smoothed RTT, weak estimator */
+  coap_tick_t rttvar_weak;	/**< RTT variation, weak estimator */
+
+  /** confirmable messages to this peer in the sendqueue */
+  unsigned int outstanding;
+  /** confirmable messages waiting for outstanding to drop below NSTART */
+  struct coap_queue_t *pending;
+
+  /** the last message id used for this peer, see coap_peer_message_id() */
+  unsigned short message_id;
+  /** last use of each of the COAP_PEER_MID_BLOCKS blocks of message ids,
+   *  allocated with the first message id */
+  coap_tick_t *mid_used;
+
+  /** confirmable messages that failed since the last ACK */
+  unsigned int fail_cnt;
+  /** registrations of this peer across all resources */
+  struct coap_registration_t *regs;
+
+  /** ACK round-trip times, allocated with the first sample, see
+   *  coap_peer_rtt_record() */
+  struct coap_histogram_t *rtt_hist;
+} coap_peer_t;
+
+typedef struct coap_peer_table_t {
+  coap_peer_t **bucket;		/**< hash chains, see COAP_PEER_BUCKETS */
+  unsigned int nbuckets;	/**< number of buckets, a power of two */
+  unsigned int count;		/**< number of peers */
+  coap_peer_t **byid;		/**< peers indexed by id, @c byid[0] unused */
+  unsigned int size;		/**< number of slots in byid */
+  coap_peer_id_t next_id;	/**< lowest id never given out */
+  coap_peer_id_t *free_ids;	/**< ids of removed peers, a stack */
+  unsigned int nfree;		/**< number of ids in free_ids */
+  coap_peer_id_t sweep;		/**< next id checked for idleness */
+} coap_peer_table_t;
+
+struct coap_context_t;
+struct coap_queue_t;
+
+/** Returns the peer with the given @p id or @c NULL if unknown. */
+static inline coap_peer_t *
+coap_peer_by_id(const coap_peer_table_t *table, coap_peer_id_t id) {
+  return id < table->size ? table->byid[id] : NULL;
+}
+
+/**
+ * Returns the state of the peer with address @p addr in @p context,
+ * or @c NULL if there is none yet.
+ */
+coap_peer_t *coap_peer_find(struct coap_context_t *context,
+			    const coap_address_t *addr);
+
+/**
+ * Returns the state of the peer with address @p addr in @p context,
+ * creating it if needed. Each new peer checks COAP_PEER_SWEEP others
+ * in turn and removes them if they are idle, see @ref peer. The ids
+ * of peers with registrations or confirmable messages stay valid.
+ *
+ * @param context The context to use.
+ * @param addr    The address of the peer.
+ * @return The peer or @c NULL on error.
+ */
+coap_peer_t *coap_peer_get(struct coap_context_t *context,
+			   const coap_address_t *addr);
+
+/** Releases the storage of all peers of @p context, including
+ *  messages that are still pending. */
+void coap_delete_peers(struct coap_context_t *context);
+
+/**
+ * Returns a new message id for a message to @p peer in host byte
+ * order. Each peer has a message id space of its own, so the rate of
+ * messages to one peer, not the rate of the whole context, is what
+ * limits reuse of a message id within EXCHANGE_LIFETIME. Message ids
+ * are handed out in blocks, and a block that has been used within
+ * EXCHANGE_LIFETIME is skipped. Only if all blocks have, the least
+ * recently used one is taken and the reuse is logged.
+ *
+ * @param peer The peer the message is sent to.
+ * @param now  The current time.
+ * @return The next message id of @p peer.
+ */
+unsigned short coap_peer_message_id(coap_peer_t *peer, coap_tick_t now);
+
+/**
+ * Returns the current RTO of @p peer at time @p now, after aging it
+ * if it has not been updated for a while.
+ */
+coap_tick_t coap_peer_rto(coap_peer_t *peer, coap_tick_t now);
+
+/**
+ * Returns the backoff factor for a transaction that started with an
+ * RTO of @p rto, in units of 1/2: 1.5 for large, 3 for small and 2
+ * for all other RTOs.
+ */
+unsigned int coap_peer_backoff(coap_tick_t rto);
+
+/**
+ * Feeds the round-trip time @p rtt of an exchange with @p peer into
+ * its estimators. @p retransmissions is the number of retransmissions
+ * the exchange needed; samples after more than two are discarded.
+ *
+ * @param peer            The peer to update.
+ * @param rtt             The time from the first transmission to the ACK.
+ * @param retransmissions The number of retransmissions.
+ * @param now             The current time.
+ */
+void coap_peer_rtt_sample(coap_peer_t *peer, coap_tick_t rtt,
+			  unsigned int retransmissions, coap_tick_t now);
+
+/**
+ * Records the time @p rtt from the first transmission of a
+ * confirmable message to @p peer until its ACK in the RTT histogram
+ * of @p peer. Unlike coap_peer_rtt_sample(), this takes every sample,
+ * also those after retransmissions. Query the histogram with
+ * coap_histogram_percentile().
+ */
+void coap_peer_rtt_record(coap_peer_t *peer, coap_tick_t rtt);
+
+/** @} */
+
+#endif /* _COAP_PEER_H_ */
@@ -16,6 +16,10 @@
 
 #include "config.h"
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
 /** 
  * @defgroup prng Pseudo Random Numbers
  * @{
@@ -79,6 +83,91 @@ contiki_prng_impl(unsigned char *buf, size_t len) {
 #define prng_init(Value) srand((unsigned long)(Value))
 #endif
 
+/**
+ * State of a xoshiro128** generator. Every context has one of its own
+ * (see coap_context_t), so drawing numbers neither takes the lock of
+ * rand() nor shares state between threads. It is not suitable for
+ * cryptographic purposes.
+ */
+typedef struct {
+  uint32_t s[4];
+} coap_prng_t;
+
+/** Returns @p x scrambled by the splitmix64 finalizer. */
+static inline uint64_t
+coap_prng_mix(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/** Initializes @p r from @p seed. Any seed, including 0, is fine. */
+static inline void
+coap_prng_seed(coap_prng_t *r, uint64_t seed) {
+  uint64_t a = coap_prng_mix(seed + 0x9e3779b97f4a7c15ULL);
+  uint64_t b = coap_prng_mix(seed + 2 * 0x9e3779b97f4a7c15ULL);
+
+  r->s[0] = (uint32_t)a;
+  r->s[1] = (uint32_t)(a >> 32);
+  r->s[2] = (uint32_t)b;
+  r->s[3] = (uint32_t)(b >> 32) | 1;	/* never all zero */
+}
+
+static inline uint32_t
+coap_prng_rotl(uint32_t x, int k) {
+  return (x << k) | (x >> (32 - k));
+}
+
+/** Returns the next 32 random bits from @p r. */
+static inline uint32_t
+coap_prng_next(coap_prng_t *r) {
+  uint32_t result = coap_prng_rotl(r->s[1] * 5, 7) * 9;
+  uint32_t t = r->s[1] << 9;
+
+  r->s[2] ^= r->s[0];
+  r->s[3] ^= r->s[1];
+  r->s[1] ^= r->s[2];
+  r->s[0] ^= r->s[3];
+  r->s[2] ^= t;
+  r->s[3] = coap_prng_rotl(r->s[3], 11);
+  return result;
+}
+
+/** Returns a random number in [0, @p n), or 0 if @p n is 0. */
+static inline uint64_t
+coap_prng_below(coap_prng_t *r, uint64_t n) {
+  uint64_t x;
+
+  if (n <= 0xffffffffULL)	/* no division needed */
+    return ((uint64_t)coap_prng_next(r) * n) >> 32;
+
+  x = (uint64_t)coap_prng_next(r) << 32 | coap_prng_next(r);
+  return x % n;
+}
+
+/** Fills @p buf with @p len random bytes from @p r. */
+static inline void
+coap_prng_fill(coap_prng_t *r, unsigned char *buf, size_t len) {
+  uint32_t v;
+
+  while (len >= sizeof(v)) {
+    v = coap_prng_next(r);
+    memcpy(buf, &v, sizeof(v));
+    buf += sizeof(v);
+    len -= sizeof(v);
+  }
+  if (len) {
+    v = coap_prng_next(r);
+    memcpy(buf, &v, len);
+  }
+}
+
+/**
+ * Seeds @p r from the random source of the operating system, mixing
+ * in @p extra in case there is none.
+ */
+void coap_prng_seed_os(coap_prng_t *r, uint64_t extra);
+
 /** @} */
 
 #endif /* _COAP_PRNG_H_ */
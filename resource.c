@@ -11,6 +11,7 @@
 #include "debug.h"
 #include "resource.h"
 #include "subscribe.h"
+#include "trace.h"
 
 #ifndef WITH_CONTIKI
 #include "utlist.h"
@@ -334,9 +335,11 @@ int
 coap_delete_resource(coap_context_t *context, coap_key_t key) {
   coap_resource_t *resource;
   coap_attr_t *attr, *tmp;
-#ifdef WITH_CONTIKI
+#ifndef WITH_CONTIKI
+  coap_registration_t *reg;
+#else /* WITH_CONTIKI */
   coap_subscription_t *obs;
-#endif
+#endif /* WITH_CONTIKI */
 
   if (!context)
     return 0;
@@ -349,6 +352,29 @@ coap_delete_resource(coap_context_t *context, coap_key_t key) {
 #ifndef WITH_CONTIKI
   HASH_DELETE(hh, context->resources, resource);
 
+  /* drop the references the queue of the notification scheduler
+   * holds, so that its registrations can be queued again */
+  while ((reg = resource->notify_queue)) {
+    resource->notify_queue = reg->notify_next;
+    reg->notify_next = NULL;
+    reg->notify_queued = 0;
+    coap_registration_release(resource, reg);
+  }
+
+  /* leave the round robin list of the notification scheduler */
+  if (resource->notify_active) {
+    coap_resource_t *prev = NULL, *r;
+
+    for (r = context->notify_head; r != resource; r = r->notify_next)
+      prev = r;
+    if (prev)
+      prev->notify_next = resource->notify_next;
+    else
+      context->notify_head = resource->notify_next;
+    if (context->notify_tail == resource)
+      context->notify_tail = prev;
+  }
+
   /* delete registered attributes */
   LL_FOREACH_SAFE(resource->link_attr, attr, tmp) coap_delete_attr(attr);
 
@@ -602,6 +628,8 @@ coap_check_notify(coap_context_t *context) {
 #ifndef WITH_CONTIKI
   coap_resource_t *tmp;
 
+  coap_clock_update(context);
+  coap_clean_expired_mids(context);
   HASH_ITER(hh, context->resources, r, tmp) {
     if (r->observable && r->dirty && r->subscribers) {
 #else /* WITH_CONTIKI */
@@ -640,7 +668,7 @@ coap_check_notify(coap_context_t *context) {
 	token.length = obs->token_length;
 	token.s = obs->token;
 
-	response->hdr->id = coap_new_message_id(context);
+	response->hdr->id = coap_new_peer_message_id(context, &obs->subscriber);
 	if (obs->non && obs->non_cnt < COAP_OBS_MAX_NON)
 	  response->hdr->type = COAP_MESSAGE_NON;
 	else
@@ -666,6 +694,13 @@ coap_check_notify(coap_context_t *context) {
     }
     r->dirty = 0;
   }
+
+#ifndef WITH_CONTIKI
+  /* send held back notifications and pmax refreshes */
+  coap_check_due(context);
+
+  coap_schedule_notifications(context);
+#endif /* WITH_CONTIKI */
 }
 
 void
@@ -778,7 +813,8 @@ coap_registration_release(coap_resource_t *res,
 
 	assert(r);
 	r->refcnt--;
-	LOGI("Released registration, old ref count:%d, new: %d", r->refcnt+1, r->refcnt);
+	coap_trace(COAP_TRACE_REG_REFCNT, ntohs(r->subscriber.addr.sin.sin_port),
+		   r->refcnt, 0);
 
 	if (r->refcnt == 0) {
 		/* Unfortunately as it is a single-linked list
@@ -794,8 +830,12 @@ coap_registration_release(coap_resource_t *res,
 			if (p != NULL) p->next = r->next;
 		}*/
 		LL_DELETE(res->subscribers, r);
+		res->notifications += (unsigned int)r->datapackcount;
+		res->notify_bytes += (unsigned int)r->octcount;
+		coap_probe(registration_remove, r, r->peer, r->datapackcount,
+			   r->octcount);
 		LOGI("Freeing registration");
-		free(r);
+		coap_registration_free(r);
 	}
 }
 
@@ -803,7 +843,8 @@ coap_registration_t *
 coap_registration_checkout(coap_registration_t *r) {
 	assert(r);
 	r->refcnt++;
-	LOGI("Checked out registration, new ref count:%d", r->refcnt);
+	coap_trace(COAP_TRACE_REG_REFCNT, ntohs(r->subscriber.addr.sin.sin_port),
+		   r->refcnt, 0);
 	return r;
 }
 
@@ -815,10 +856,6 @@ coap_add_registration(coap_resource_t *resource,
 	coap_registration_t *s = NULL, *found = NULL;
 	assert(peer);
 
-	char addrstr[INET_ADDRSTRLEN]; // space to hold the IPv4 string
-	struct sockaddr_in sa; // pretend this is loaded with something
-	inet_ntop(AF_INET, &(peer->addr.sin.sin_addr), addrstr, INET_ADDRSTRLEN);
-	LOGW("Adding registration to: %s : %d", addrstr, peer->addr.sin.sin_port);
 
 	/* Note: coap_find_registration checks on the equality of peer,
 	 * but if a registration in not anymore valid even if it has the
@@ -831,10 +868,11 @@ coap_add_registration(coap_resource_t *resource,
 	 * the value of this pointer identifies the observer at
 	 * the streaming manager level.
 	 */
+	coap_trace(COAP_TRACE_REG_ADD, ntohs(peer->addr.sin.sin_port), !found, 0);
 	if (found) {
 		found->token_length = token->length;
 		memset(found->token, 0, 8);
-		memcpy(found->token, token->s, min(s->token_length, 8));
+		memcpy(found->token, token->s, min(token->length, 8));
 		//no need to copy subscriber, it's the same one
 
 		//s = coap_registration_checkout(found);
@@ -842,7 +880,6 @@ coap_add_registration(coap_resource_t *resource,
 	}
 	/* Add, prepending. */
 	else {
-		LOGI("Adding registration");
 		s = coap_registration_init(resource->key, *peer, token);
 		s->next = resource->subscribers;
 		/* Generate a new ticket,
@@ -854,6 +891,7 @@ coap_add_registration(coap_resource_t *resource,
 		//resource->subscribers = coap_registration_checkout(s);
 		resource->subscribers = s;
 	}
+	coap_probe(registration_add, s, s->peer, !found, s->token_length);
 	return s;
 }
 
@@ -888,19 +926,15 @@ coap_find_registration(coap_resource_t *resource,
 	coap_registration_t *s = NULL;
 
 	s = resource->subscribers;
-	if (s==NULL) LOGI("Subscribers list NULL");
 	while (s != NULL) {
 		if ( coap_address_equals(&(s->subscriber), peer) == 1
 				&&  !(s->invalid)  )
 			break;
-		if ( coap_address_equals(&(s->subscriber), peer) == 1 )
-			LOGI("Peers were equal but registration invalid");
-		else if ( !(s->invalid) )
-			LOGI("Registration is valid but peers differ");
-		else LOGI("Problem for both");
 		s = s->next;
 	}
 
+	coap_trace(COAP_TRACE_REG_FIND, ntohs(peer->addr.sin.sin_port), s != NULL, 0);
+
 	return s;
 }
 
@@ -101,6 +101,29 @@ typedef struct coap_resource_t {
    */
   coap_registration_handler_t on_unregister;
 
+  /**
+   * Share of this resource in the notification rate when the
+   * notification scheduler is enabled (see coap_set_notify_rate()).
+   * A weight of @c 0 counts as @c 1.
+   */
+  unsigned int weight;
+  size_t deficit;	/**< scheduler deficit in bytes */
+
+  /* While it has notifications to send, the resource is in the round
+   * robin list of the scheduler and its registrations wait in
+   * notify_queue, see coap_schedule_notifications(). */
+  struct coap_resource_t *notify_next;
+  int notify_active;	/**< in the round robin list */
+  int notify_granted;	/**< got its quantum in the current round */
+  coap_registration_t *notify_queue;
+  coap_registration_t *notify_queue_tail;
+
+  /* counters, see coap_resource_metrics(); registrations add theirs
+   * to notifications and notify_bytes when they are freed */
+  uint64_t requests;
+  uint64_t notifications;
+  uint64_t notify_bytes;
+
   /**
    * Request URI for this resource. This field will point into the
    * static memory. */
@@ -0,0 +1,186 @@
+/* ring.c -- lock-free single producer single consumer ring
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file ring.c
+ * @brief lock-free single producer single consumer ring
+ */
+
+/* posix_memalign() is not declared in strict C99 mode */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "debug.h"
+#include "ring.h"
+
+#define COAP_ALIGNED __attribute__((aligned(COAP_CACHELINE_SIZE)))
+
+struct coap_ring_t {
+  /* read-only after coap_ring_new() */
+  size_t mask;			/**< number of slots minus one */
+  int fd;			/**< eventfd or -1 */
+
+  /* producer side */
+  COAP_ALIGNED size_t head;	/**< next slot to write */
+  size_t tail_cache;		/**< producer's copy of tail */
+
+  /* consumer side */
+  COAP_ALIGNED size_t tail;	/**< next slot to read */
+  size_t head_cache;		/**< consumer's copy of head */
+
+  /** set by the consumer before it sleeps on fd */
+  COAP_ALIGNED int waiting;
+
+  COAP_ALIGNED void *slot[];
+};
+
+coap_ring_t *
+coap_ring_new(size_t size) {
+  coap_ring_t *ring;
+  size_t n = 1;
+
+  while (n < size)
+    n <<= 1;
+
+  /* the cache line alignment of the members only holds if the ring
+   * itself starts on a cache line */
+  if (posix_memalign((void **)&ring, COAP_CACHELINE_SIZE,
+		     sizeof(coap_ring_t) + n * sizeof(void *)) != 0) {
+#ifndef NDEBUG
+    coap_log(LOG_CRIT, "coap_ring_new: malloc\n");
+#endif
+    return NULL;
+  }
+
+  memset(ring, 0, sizeof(coap_ring_t));
+  ring->mask = n - 1;
+#ifdef HAVE_SYS_EVENTFD_H
+  ring->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ring->fd < 0)
+    warn("coap_ring_new: no eventfd, consumer has to poll\n");
+#else
+  ring->fd = -1;
+#endif
+  return ring;
+}
+
+void
+coap_ring_free(coap_ring_t *ring) {
+  if (!ring)
+    return;
+#ifdef HAVE_SYS_EVENTFD_H
+  if (ring->fd >= 0)
+    close(ring->fd);
+#endif
+  free(ring);
+}
+
+static inline void
+coap_ring_wakeup(coap_ring_t *ring) {
+#ifdef HAVE_SYS_EVENTFD_H
+  /* Pairs with the fence in coap_ring_prepare_wait(): either the
+   * consumer sees the new head or we see its waiting flag. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_RELAXED)) {
+    eventfd_write(ring->fd, 1);
+  }
+#else
+  (void)ring;
+#endif
+}
+
+size_t
+coap_ring_push(coap_ring_t *ring, void * const *items, size_t n) {
+  size_t head = ring->head;
+  size_t avail = ring->mask + 1 - (head - ring->tail_cache);
+  size_t i;
+
+  if (avail < n) {
+    ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    avail = ring->mask + 1 - (head - ring->tail_cache);
+    if (avail < n)
+      n = avail;
+  }
+
+  if (!n)
+    return 0;
+
+  for (i = 0; i < n; i++)
+    ring->slot[(head + i) & ring->mask] = items[i];
+
+  __atomic_store_n(&ring->head, head + n, __ATOMIC_RELEASE);
+  coap_ring_wakeup(ring);
+  return n;
+}
+
+size_t
+coap_ring_pop(coap_ring_t *ring, void **items, size_t n) {
+  size_t tail = ring->tail;
+  size_t avail = ring->head_cache - tail;
+  size_t i;
+
+  if (avail < n) {
+    ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    avail = ring->head_cache - tail;
+    if (avail < n)
+      n = avail;
+  }
+
+  if (!n)
+    return 0;
+
+  for (i = 0; i < n; i++)
+    items[i] = ring->slot[(tail + i) & ring->mask];
+
+  __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+int
+coap_ring_fd(const coap_ring_t *ring) {
+  return ring->fd;
+}
+
+int
+coap_ring_prepare_wait(coap_ring_t *ring) {
+  if (ring->fd < 0)
+    return 0;
+
+  __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+  return 1;
+}
+
+void
+coap_ring_finish_wait(coap_ring_t *ring) {
+#ifdef HAVE_SYS_EVENTFD_H
+  eventfd_t value;
+
+  __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+  if (ring->fd >= 0)
+    eventfd_read(ring->fd, &value);
+#else
+  (void)ring;
+#endif
+}
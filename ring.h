@@ -0,0 +1,120 @@
+/* ring.h -- lock-free single producer single consumer ring
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file ring.h
+ * @brief lock-free single producer single consumer ring
+ */
+
+#ifndef _COAP_RING_H_
+#define _COAP_RING_H_
+
+#include "config.h"
+
+#include <stddef.h>
+
+/**
+ * @defgroup ring Descriptor Rings
+ * @{
+ * A coap_ring_t passes opaque descriptors (e.g. samples of the
+ * streaming manager) from exactly one producer thread to exactly one
+ * consumer thread without locks. Head and tail live on separate cache
+ * lines, and each side keeps a private copy of the other side's index
+ * so that the shared lines are only touched once per batch.
+ *
+ * If the platform has eventfd(2), the consumer can sleep in select()
+ * on coap_ring_fd(). The producer only writes to the eventfd when the
+ * consumer has announced with coap_ring_prepare_wait() that it is
+ * about to sleep, so a busy consumer costs the producer no system
+ * calls.
+ */
+
+#ifndef COAP_RING_SIZE
+/** Suggested number of slots of a ring between the streaming manager
+ *  and the network loop. */
+#define COAP_RING_SIZE 256
+#endif /* COAP_RING_SIZE */
+
+#ifndef COAP_CACHELINE_SIZE
+#define COAP_CACHELINE_SIZE 64
+#endif /* COAP_CACHELINE_SIZE */
+
+typedef struct coap_ring_t coap_ring_t;
+
+/**
+ * Creates a new ring that can hold @p size descriptors. @p size is
+ * rounded up to the next power of two.
+ *
+ * @param size The minimum number of slots.
+ * @return The new ring or @c NULL on error.
+ */
+coap_ring_t *coap_ring_new(size_t size);
+
+/** Releases the storage allocated for @p ring and closes its eventfd. */
+void coap_ring_free(coap_ring_t *ring);
+
+/**
+ * Appends up to @p n descriptors from @p items to @p ring. Must only
+ * be called by the producer. Wakes up the consumer if it is waiting.
+ *
+ * @param ring  The ring to fill.
+ * @param items The descriptors to append.
+ * @param n     The number of descriptors in @p items.
+ * @return The number of descriptors actually appended, which is less
+ *         than @p n if the ring is full.
+ */
+size_t coap_ring_push(coap_ring_t *ring, void * const *items, size_t n);
+
+/**
+ * Removes up to @p n descriptors from @p ring and stores them in
+ * @p items. Must only be called by the consumer.
+ *
+ * @param ring  The ring to drain.
+ * @param items Storage for at least @p n descriptors.
+ * @param n     The maximum number of descriptors to remove.
+ * @return The number of descriptors stored in @p items.
+ */
+size_t coap_ring_pop(coap_ring_t *ring, void **items, size_t n);
+
+/** Appends the single descriptor @p item. Returns @c 1 on success. */
+static inline int
+coap_ring_put(coap_ring_t *ring, void *item) {
+  return coap_ring_push(ring, &item, 1) == 1;
+}
+
+/** Removes a single descriptor, returns @c NULL if @p ring is empty. */
+static inline void *
+coap_ring_get(coap_ring_t *ring) {
+  void *item;
+  return coap_ring_pop(ring, &item, 1) ? item : NULL;
+}
+
+/**
+ * Returns the file descriptor that becomes readable when the producer
+ * wakes up the consumer, or @c -1 if eventfd is not available.
+ */
+int coap_ring_fd(const coap_ring_t *ring);
+
+/**
+ * Announces that the consumer is going to wait on coap_ring_fd().
+ * The consumer must not sleep if this function returns @c 0, as
+ * descriptors have arrived in the meantime.
+ *
+ * @param ring The ring to wait for.
+ * @return @c 1 if the consumer may sleep, @c 0 if @p ring is not
+ *         empty or cannot signal.
+ */
+int coap_ring_prepare_wait(coap_ring_t *ring);
+
+/**
+ * Acknowledges a wakeup after the consumer has returned from waiting
+ * on coap_ring_fd(). This clears the eventfd.
+ */
+void coap_ring_finish_wait(coap_ring_t *ring);
+
+/** @} */
+
+#endif /* _COAP_RING_H_ */
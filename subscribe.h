@@ -28,6 +28,36 @@
 #define COAP_OBS_MAX_NON   5
 #endif /* COAP_OBS_MAX_NON */
 
+/* Registrations adapt the number of non-confirmable notifications
+ * between two confirmable ones to the observed losses (see
+ * coap_notify()), starting from COAP_OBS_MAX_NON. */
+#ifndef COAP_OBS_MIN_NON_RUN
+#define COAP_OBS_MIN_NON_RUN 1	/**< floor of the NON run length */
+#endif
+#ifndef COAP_OBS_MAX_NON_RUN
+#define COAP_OBS_MAX_NON_RUN 100 /**< ceiling of the NON run length */
+#endif
+#ifndef COAP_OBS_MAX_SILENCE
+/** Seconds after which a confirmable notification should be sent
+ *  at the latest, so that dead observers are detected. */
+#define COAP_OBS_MAX_SILENCE 10
+#endif
+
+#ifndef COAP_OBS_STALE_GAPS
+/** Notification periods after which the sample of a confirmable
+ *  notification is stale and no longer retransmitted, unless the
+ *  observer gave a freshness or the notification has a Max-Age. */
+#define COAP_OBS_STALE_GAPS 4
+#endif
+
+#ifndef COAP_OBS_LEASE
+/** Seconds a registration lives without being refreshed by another
+ *  GET with Observe, unless the observer asks for a different lease
+ *  with the Uri-Query attribute lease. 0 means forever, so that
+ *  observers that keep acknowledging are not dropped. */
+#define COAP_OBS_LEASE 0
+#endif
+
 #ifndef COAP_OBS_MAX_FAIL
 /**
  * Number of confirmable notifications that may fail (i.e. time out
@@ -37,6 +67,24 @@
 #define COAP_OBS_MAX_FAIL  3
 #endif /* COAP_OBS_MAX_FAIL */
 
+#ifndef COAP_OBS_MAX_INFLIGHT
+/**
+ * Number of confirmable notifications that may be outstanding for
+ * one registration. Further notifications are held back, newer ones
+ * replacing older ones, until an ACK arrives.
+ */
+#define COAP_OBS_MAX_INFLIGHT 1
+#endif /* COAP_OBS_MAX_INFLIGHT */
+
+#ifndef COAP_OBS_AGG_DELAY
+/**
+ * Time in milliseconds a sample may be held back for aggregation
+ * when the observer has only limited the number of samples per
+ * notification (see coap_notify()).
+ */
+#define COAP_OBS_AGG_DELAY 100
+#endif /* COAP_OBS_AGG_DELAY */
+
 /** Subscriber information */
 typedef struct coap_subscription_t {
   struct coap_subscription_t *next; /**< next element in linked list */
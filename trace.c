@@ -0,0 +1,103 @@
+/* trace.c -- binary event tracing
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file trace.c
+ * @brief binary event tracing
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "trace.h"
+
+int coap_trace_level = COAP_TRACE_OFF;
+
+#ifdef COAP_PROBES
+/* The tracer finds the semaphores through the probe notes and writes
+ * them, they must live in the .probes section. */
+#define COAP_PROBE_DEFINE(Name)						\
+  unsigned short libcoap_##Name##_semaphore				\
+    __attribute__ ((section (".probes")));
+COAP_PROBES(COAP_PROBE_DEFINE)
+#undef COAP_PROBE_DEFINE
+#endif /* COAP_PROBES */
+
+static coap_trace_record_t coap_trace_ring[COAP_TRACE_SIZE];
+static unsigned int coap_trace_head;	/**< records written so far */
+
+static const char *coap_trace_names[COAP_TRACE_EVENT_MAX] = {
+  "?", "send", "recv", "con-queued", "retransmit", "ack", "rst",
+  "request", "response", "duplicate", "mid-expired", "dropped",
+  "reg-add", "reg-find", "reg-refcnt"
+};
+
+void
+coap_set_trace_level(int level) {
+  if (level > COAP_TRACE_LEVEL)
+    level = COAP_TRACE_LEVEL;
+  __atomic_store_n(&coap_trace_level, level, __ATOMIC_RELAXED);
+}
+
+void
+coap_trace_record(unsigned short event, unsigned int a,
+		  unsigned int b, unsigned int c) {
+  unsigned int seq = __atomic_add_fetch(&coap_trace_head, 1, __ATOMIC_RELAXED);
+  coap_trace_record_t *r = &coap_trace_ring[(seq - 1) & (COAP_TRACE_SIZE - 1)];
+
+  /* readers skip the record until seq is set again */
+  __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  r->event = event;
+  coap_ticks(&r->t);
+  r->arg[0] = a;
+  r->arg[1] = b;
+  r->arg[2] = c;
+
+  __atomic_store_n(&r->seq, seq, __ATOMIC_RELEASE);
+}
+
+size_t
+coap_trace_snapshot(coap_trace_record_t *records, size_t max) {
+  unsigned int head = __atomic_load_n(&coap_trace_head, __ATOMIC_ACQUIRE);
+  unsigned int seq;
+  size_t n = 0;
+
+  if (max > COAP_TRACE_SIZE)
+    max = COAP_TRACE_SIZE;
+  if (max > head)
+    max = head;
+
+  for (seq = head - max + 1; seq != head + 1; seq++) {
+    coap_trace_record_t *r = &coap_trace_ring[(seq - 1) & (COAP_TRACE_SIZE - 1)];
+
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq)
+      continue;
+    memcpy(&records[n], r, sizeof(coap_trace_record_t));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq)
+      n++;
+  }
+
+  return n;
+}
+
+const char *
+coap_trace_event_name(unsigned short event) {
+  return event < COAP_TRACE_EVENT_MAX ? coap_trace_names[event] : "?";
+}
+
+void
+coap_trace_print(FILE *f, const coap_trace_record_t *record) {
+  fprintf(f, "%u %llu.%09llu %s %u %u %u\n", record->seq,
+	  (unsigned long long)(record->t / COAP_TICKS_PER_SECOND),
+	  (unsigned long long)(record->t % COAP_TICKS_PER_SECOND)
+	  * 1000000000ULL / COAP_TICKS_PER_SECOND,
+	  coap_trace_event_name(record->event),
+	  record->arg[0], record->arg[1], record->arg[2]);
+}
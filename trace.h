@@ -0,0 +1,212 @@
+/* trace.h -- binary event tracing
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file trace.h
+ * @brief binary event tracing
+ */
+
+#ifndef _COAP_TRACE_H_
+#define _COAP_TRACE_H_
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "coap_time.h"
+
+/**
+ * @defgroup trace Tracing
+ * @{
+ * Events on the packet path are recorded as fixed-size binary records
+ * in a lock-free ring buffer instead of being formatted as text.
+ * Records are turned into text only when somebody reads them, see
+ * coap_trace_snapshot() and coap_trace_print().
+ *
+ * Tracing has two switches. COAP_TRACE_LEVEL is the highest level
+ * compiled in; trace points above it disappear. coap_set_trace_level()
+ * selects the level at run time, which costs one well-predicted
+ * branch per trace point while tracing is off.
+ */
+
+#define COAP_TRACE_OFF     0	/**< no tracing */
+#define COAP_TRACE_EVENTS  1	/**< binary records of packet events */
+#define COAP_TRACE_VERBOSE 2	/**< also text dumps of every PDU */
+
+#ifndef COAP_TRACE_LEVEL
+/** The highest trace level compiled in. */
+#define COAP_TRACE_LEVEL COAP_TRACE_EVENTS
+#endif /* COAP_TRACE_LEVEL */
+
+#ifndef COAP_TRACE_SIZE
+/** Number of records in the trace ring, a power of two. */
+#define COAP_TRACE_SIZE 4096
+#endif /* COAP_TRACE_SIZE */
+
+/** Trace events. The meaning of the arguments is given per event. */
+typedef enum {
+  COAP_TRACE_SEND = 1,		/**< type << 8 | code, message id, bytes */
+  COAP_TRACE_RECV,		/**< type << 8 | code, message id, bytes */
+  COAP_TRACE_CON_QUEUED,	/**< message id, transaction id, reg != NULL */
+  COAP_TRACE_RETRANSMIT,	/**< message id, transaction id, count */
+  COAP_TRACE_ACK,		/**< message id, transaction found, observe */
+  COAP_TRACE_RST,		/**< message id, transaction found, observe */
+  COAP_TRACE_REQUEST,		/**< message id, transaction id, code */
+  COAP_TRACE_RESPONSE,		/**< message id, transaction id, code */
+  COAP_TRACE_DUPLICATE,		/**< message id, type of the original reply */
+  COAP_TRACE_MID_EXPIRED,	/**< message id */
+  COAP_TRACE_DROPPED,		/**< message id, code */
+  COAP_TRACE_REG_ADD,		/**< port, 1 if new */
+  COAP_TRACE_REG_FIND,		/**< port, 1 if found */
+  COAP_TRACE_REG_REFCNT,	/**< port, new reference count */
+  COAP_TRACE_EVENT_MAX
+} coap_trace_event_t;
+
+/** One trace record. */
+typedef struct {
+  unsigned int seq;		/**< sequence number, 0 while being written */
+  unsigned short event;		/**< a coap_trace_event_t */
+  coap_tick_t t;		/**< when the event happened */
+  unsigned int arg[3];		/**< event arguments */
+} coap_trace_record_t;
+
+/** The run-time trace level, do not set directly. */
+extern int coap_trace_level;
+
+/** Sets the run-time trace level, capped at COAP_TRACE_LEVEL. */
+void coap_set_trace_level(int level);
+
+/**
+ * Evaluates to non-zero if trace points of @p Level are compiled in
+ * and enabled.
+ *
+ * @hideinitializer
+ */
+#define coap_trace_on(Level)						\
+  ((Level) <= COAP_TRACE_LEVEL &&					\
+   __builtin_expect((Level) <= coap_trace_level, 0))
+
+/**
+ * Records @p Event with arguments @p A, @p B and @p C if event
+ * tracing is enabled.
+ *
+ * @hideinitializer
+ */
+#define coap_trace(Event, A, B, C)					\
+  do {									\
+    if (coap_trace_on(COAP_TRACE_EVENTS))				\
+      coap_trace_record((Event), (A), (B), (C));			\
+  } while (0)
+
+/**
+ * Appends a record to the trace ring, overwriting the oldest one when
+ * the ring is full. Safe to call from several threads at once. Use
+ * coap_trace() instead of calling this directly.
+ */
+void coap_trace_record(unsigned short event, unsigned int a,
+		       unsigned int b, unsigned int c);
+
+/**
+ * Copies up to @p max of the latest records, oldest first, to
+ * @p records. Records that are overwritten during the copy are
+ * skipped.
+ *
+ * @param records Storage for at least @p max records.
+ * @param max     The maximum number of records to copy.
+ * @return The number of records copied.
+ */
+size_t coap_trace_snapshot(coap_trace_record_t *records, size_t max);
+
+/** Returns the name of @p event. */
+const char *coap_trace_event_name(unsigned short event);
+
+/** Writes @p record as one line of text to @p f. */
+void coap_trace_print(FILE *f, const coap_trace_record_t *record);
+
+/** @} */
+
+/**
+ * @defgroup probes Static probes
+ * @{
+ * USDT probes of provider @c libcoap for perf, bpftrace and
+ * SystemTap, compiled in where <sys/sdt.h> is available (define
+ * WITHOUT_PROBES to leave them out). Unlike uprobes on functions they
+ * survive changes to inlining. Every probe has a semaphore that the
+ * tracer increments while it is attached, so a probe point costs one
+ * load and a not-taken branch otherwise and its arguments are not
+ * evaluated.
+ *
+ * Probes and their arguments:
+ *
+ * - @c receive: mid, peer id, type, bytes (coap_read())
+ * - @c dispatch_start, @c dispatch_end: mid, peer id, type, bytes
+ * - @c handler_entry: mid, peer id, request code, bytes
+ * - @c handler_exit: mid, peer id, response code, response bytes
+ * - @c send: mid, peer id, type, bytes
+ * - @c retransmit: mid, peer id, retransmission count, bytes
+ * - @c transaction_complete: mid, peer id, ACK or RST, ticks since
+ *   the first transmission
+ * - @c registration_add: registration, peer id, 1 if new, token length
+ * - @c registration_remove: registration, peer id, notifications,
+ *   notification bytes
+ * - @c dedup_hit: mid, peer id, type, type of the original reply
+ *
+ * Message ids are in host byte order, peer ids are those of
+ * coap_peer_by_id(), @c 0 if there is none.
+ */
+
+#if !defined(WITHOUT_PROBES) && !defined(HAVE_SYS_SDT_H) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SYS_SDT_H 1
+#endif
+#endif
+
+#if defined(HAVE_SYS_SDT_H) && !defined(WITHOUT_PROBES)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define COAP_PROBES(Probe)						\
+  Probe(receive) Probe(dispatch_start) Probe(dispatch_end)		\
+  Probe(handler_entry) Probe(handler_exit) Probe(send)			\
+  Probe(retransmit) Probe(transaction_complete)			\
+  Probe(registration_add) Probe(registration_remove) Probe(dedup_hit)
+
+#define COAP_PROBE_DECLARE(Name)					\
+  extern unsigned short libcoap_##Name##_semaphore;
+COAP_PROBES(COAP_PROBE_DECLARE)
+#undef COAP_PROBE_DECLARE
+
+/**
+ * Evaluates to non-zero while a tracer is attached to probe @p Name.
+ *
+ * @hideinitializer
+ */
+#define coap_probe_on(Name)						\
+  __builtin_expect(__atomic_load_n(&libcoap_##Name##_semaphore,	\
+				   __ATOMIC_RELAXED), 0)
+
+/**
+ * Fires probe @p Name with arguments @p A, @p B, @p C and @p D.
+ *
+ * @hideinitializer
+ */
+#define coap_probe(Name, A, B, C, D)					\
+  do {									\
+    if (coap_probe_on(Name))						\
+      STAP_PROBE4(libcoap, Name, (A), (B), (C), (D));			\
+  } while (0)
+
+#else /* HAVE_SYS_SDT_H && !WITHOUT_PROBES */
+
+#define coap_probe_on(Name) 0
+#define coap_probe(Name, A, B, C, D) do { } while (0)
+
+#endif /* HAVE_SYS_SDT_H && !WITHOUT_PROBES */
+
+/** @} */
+
+#endif /* _COAP_TRACE_H_ */
@@ -0,0 +1,213 @@
+/* transport.c -- datagram transports of a context
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file transport.c
+ * @brief datagram transports of a context
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#include "mem.h"
+#include "debug.h"
+#include "pdu.h"
+#include "transport.h"
+
+static ssize_t
+coap_udp_send(coap_transport_t *transport, const coap_address_t *dst,
+	      const unsigned char *data, size_t len) {
+  return sendto(transport->fd, data, len, 0, &dst->addr.sa, dst->size);
+}
+
+static ssize_t
+coap_udp_recv(coap_transport_t *transport, coap_address_t *src,
+	      unsigned char *buf, size_t len) {
+  return recvfrom(transport->fd, buf, len, 0, &src->addr.sa, &src->size);
+}
+
+void
+coap_udp_transport_init(coap_transport_t *transport, int fd) {
+  memset(transport, 0, sizeof(coap_transport_t));
+  transport->name = "udp";
+  transport->send = coap_udp_send;
+  transport->recv = coap_udp_recv;
+  transport->fd = fd;
+}
+
+/** A datagram in a queue of a memory transport. */
+typedef struct {
+  coap_address_t addr;		/**< source or destination */
+  size_t length;
+  unsigned char data[COAP_MAX_PDU_SIZE];
+} coap_datagram_t;
+
+/** A queue of datagrams, used as a ring. */
+typedef struct {
+  coap_datagram_t *slot;
+  size_t head;			/**< next slot to write */
+  size_t tail;			/**< next slot to read */
+} coap_datagram_queue_t;
+
+typedef struct {
+  coap_transport_t transport;	/* must be first */
+  size_t size;			/**< slots per queue */
+  int keep;			/**< keep sent datagrams */
+  coap_datagram_queue_t in, out;
+  unsigned long sent;
+  unsigned long long sent_bytes;
+} coap_memory_transport_t;
+
+static inline size_t
+coap_datagram_queue_length(coap_memory_transport_t *m,
+			   coap_datagram_queue_t *q) {
+  return (q->head + m->size - q->tail) % m->size;
+}
+
+/* One slot stays free to tell a full queue from an empty one. */
+static coap_datagram_t *
+coap_datagram_queue_put(coap_memory_transport_t *m, coap_datagram_queue_t *q,
+			const coap_address_t *addr,
+			const unsigned char *data, size_t len) {
+  coap_datagram_t *d;
+
+  if (len > COAP_MAX_PDU_SIZE || (q->head + 1) % m->size == q->tail)
+    return NULL;
+
+  d = &q->slot[q->head];
+  memcpy(&d->addr, addr, sizeof(coap_address_t));
+  memcpy(d->data, data, len);
+  d->length = len;
+  q->head = (q->head + 1) % m->size;
+  return d;
+}
+
+static ssize_t
+coap_datagram_queue_get(coap_memory_transport_t *m, coap_datagram_queue_t *q,
+			coap_address_t *addr, unsigned char *buf, size_t len) {
+  coap_datagram_t *d;
+
+  if (q->tail == q->head) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  d = &q->slot[q->tail];
+  if (addr)
+    memcpy(addr, &d->addr, sizeof(coap_address_t));
+  memcpy(buf, d->data, d->length < len ? d->length : len);
+  q->tail = (q->tail + 1) % m->size;
+  return d->length;
+}
+
+static ssize_t
+coap_memory_send(coap_transport_t *transport, const coap_address_t *dst,
+		 const unsigned char *data, size_t len) {
+  coap_memory_transport_t *m = (coap_memory_transport_t *)transport;
+
+  m->sent++;
+  m->sent_bytes += len;
+  if (m->keep && !coap_datagram_queue_put(m, &m->out, dst, data, len))
+    debug("coap_memory_send: queue full, datagram dropped\n");
+  return len;
+}
+
+static ssize_t
+coap_memory_recv(coap_transport_t *transport, coap_address_t *src,
+		 unsigned char *buf, size_t len) {
+  coap_memory_transport_t *m = (coap_memory_transport_t *)transport;
+
+  return coap_datagram_queue_get(m, &m->in, src, buf, len);
+}
+
+static void
+coap_memory_free(coap_transport_t *transport) {
+  coap_memory_transport_t *m = (coap_memory_transport_t *)transport;
+
+  coap_free(m->in.slot);
+  coap_free(m->out.slot);
+  coap_free(m);
+}
+
+coap_transport_t *
+coap_memory_transport_new(size_t size, int keep) {
+  coap_memory_transport_t *m;
+
+  m = (coap_memory_transport_t *)coap_malloc(sizeof(coap_memory_transport_t));
+  if (!m)
+    goto error;
+
+  memset(m, 0, sizeof(coap_memory_transport_t));
+  m->size = size + 1;
+  m->keep = keep;
+  m->in.slot = (coap_datagram_t *)
+    coap_malloc(m->size * sizeof(coap_datagram_t));
+  if (keep)
+    m->out.slot = (coap_datagram_t *)
+      coap_malloc(m->size * sizeof(coap_datagram_t));
+  if (!m->in.slot || (keep && !m->out.slot)) {
+    coap_memory_free(&m->transport);
+    goto error;
+  }
+
+  m->transport.name = "memory";
+  m->transport.send = coap_memory_send;
+  m->transport.recv = coap_memory_recv;
+  m->transport.free = coap_memory_free;
+  m->transport.fd = -1;
+  return &m->transport;
+
+ error:
+#ifndef NDEBUG
+  coap_log(LOG_CRIT, "coap_memory_transport_new: malloc\n");
+#endif
+  return NULL;
+}
+
+int
+coap_memory_transport_push(coap_transport_t *transport,
+			   const coap_address_t *src,
+			   const unsigned char *data, size_t len) {
+  coap_memory_transport_t *m = (coap_memory_transport_t *)transport;
+
+  return coap_datagram_queue_put(m, &m->in, src, data, len) != NULL;
+}
+
+ssize_t
+coap_memory_transport_pop(coap_transport_t *transport, coap_address_t *dst,
+			  unsigned char *buf, size_t len) {
+  coap_memory_transport_t *m = (coap_memory_transport_t *)transport;
+
+  return m->keep ? coap_datagram_queue_get(m, &m->out, dst, buf, len) : -1;
+}
+
+size_t
+coap_memory_transport_pending(coap_transport_t *transport) {
+  coap_memory_transport_t *m = (coap_memory_transport_t *)transport;
+
+  return coap_datagram_queue_length(m, &m->in);
+}
+
+unsigned long
+coap_memory_transport_sent(coap_transport_t *transport,
+			   unsigned long long *bytes) {
+  coap_memory_transport_t *m = (coap_memory_transport_t *)transport;
+
+  if (bytes)
+    *bytes = m->sent_bytes;
+  return m->sent;
+}
+
+void
+coap_free_transport(coap_transport_t *transport) {
+  if (transport && transport->free)
+    transport->free(transport);
+}
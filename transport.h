@@ -0,0 +1,133 @@
+/* transport.h -- datagram transports of a context
+ *
+ * This file is part of the CoAP library libcoap. Please see
+ * README for terms of use.
+ */
+
+/**
+ * @file transport.h
+ * @brief datagram transports of a context
+ */
+
+#ifndef _COAP_TRANSPORT_H_
+#define _COAP_TRANSPORT_H_
+
+#include "config.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "address.h"
+
+/**
+ * @defgroup transport Transports
+ * @{
+ * coap_send_impl() and coap_read() move datagrams through the
+ * transport of the context, which coap_new_context() sets to the UDP
+ * socket @c sockfd. coap_set_transport() replaces it, e.g. by a
+ * memory transport that queues datagrams in memory, so that the stack
+ * can be measured without the kernel in the way and captured traffic
+ * can be fed through coap_dispatch().
+ *
+ * A transport is a coap_transport_t with its send and receive
+ * functions. Implementations embed it as their first member.
+ */
+
+struct coap_transport_t;
+
+/**
+ * Sends the datagram @p data of @p len bytes to @p dst.
+ *
+ * @return The number of bytes sent or @c -1 on error.
+ */
+typedef ssize_t (*coap_transport_send_t)(struct coap_transport_t *transport,
+					  const coap_address_t *dst,
+					  const unsigned char *data, size_t len);
+
+/**
+ * Receives the next datagram into @p buf of @p len bytes and stores
+ * its source in @p src, whose @c size must be set to the space
+ * available.
+ *
+ * @return The number of bytes received or @c -1 on error, with @c
+ *         errno set to @c EAGAIN if there is no datagram.
+ */
+typedef ssize_t (*coap_transport_recv_t)(struct coap_transport_t *transport,
+					  coap_address_t *src,
+					  unsigned char *buf, size_t len);
+
+/** Releases @p transport, see coap_free_transport(). */
+typedef void (*coap_transport_free_t)(struct coap_transport_t *transport);
+
+typedef struct coap_transport_t {
+  const char *name;		/**< for log messages */
+  coap_transport_send_t send;
+  coap_transport_recv_t recv;
+  coap_transport_free_t free;	/**< may be @c NULL */
+
+  /** descriptor that becomes readable with input, or @c -1 */
+  int fd;
+} coap_transport_t;
+
+/**
+ * Initializes @p transport to send and receive on the UDP socket
+ * @p fd. The socket is not closed by coap_free_transport().
+ */
+void coap_udp_transport_init(coap_transport_t *transport, int fd);
+
+/**
+ * Creates a memory transport. Datagrams injected with
+ * coap_memory_transport_push() are received by coap_read() in order,
+ * and datagrams sent by the context are kept for
+ * coap_memory_transport_pop(). Both queues hold @p size datagrams of
+ * up to COAP_MAX_PDU_SIZE bytes. If @p keep is @c 0, sent datagrams
+ * are only counted, which is what a benchmark wants.
+ *
+ * A memory transport has no descriptor and must not be shared
+ * between threads.
+ *
+ * @param size The number of datagrams per queue.
+ * @param keep @c 1 to keep sent datagrams, @c 0 to drop them.
+ * @return The new transport or @c NULL on error.
+ */
+coap_transport_t *coap_memory_transport_new(size_t size, int keep);
+
+/**
+ * Queues the datagram @p data of @p len bytes from @p src for
+ * coap_read().
+ *
+ * @return @c 1 if the datagram was queued, @c 0 if the queue is full
+ *         or the datagram is too long.
+ */
+int coap_memory_transport_push(coap_transport_t *transport,
+			       const coap_address_t *src,
+			       const unsigned char *data, size_t len);
+
+/**
+ * Removes the oldest datagram sent through @p transport, storing its
+ * destination in @p dst (if not @c NULL) and up to @p len bytes of it
+ * in @p buf.
+ *
+ * @return The length of the datagram or @c -1 if there is none.
+ */
+ssize_t coap_memory_transport_pop(coap_transport_t *transport,
+				  coap_address_t *dst,
+				  unsigned char *buf, size_t len);
+
+/** Returns the number of datagrams waiting for coap_read(). */
+size_t coap_memory_transport_pending(coap_transport_t *transport);
+
+/**
+ * Returns the number of datagrams and, if @p bytes is not @c NULL,
+ * the number of bytes sent through @p transport. Datagrams dropped
+ * because the queue was full or @p keep was @c 0 are included.
+ */
+unsigned long coap_memory_transport_sent(coap_transport_t *transport,
+					 unsigned long long *bytes);
+
+/** Releases @p transport. @p transport may be @c NULL. */
+void coap_free_transport(coap_transport_t *transport);
+
+/** @} */
+
+#endif /* _COAP_TRANSPORT_H_ */